@@ -2,6 +2,7 @@
 #define AABB_H
 
 #include "headers.h"
+#include "stats.h"
 
 //axis aligned bounding box
 class aabb {
@@ -44,6 +45,7 @@ class aabb {
 
     //checks if a ray hit the bounding box
     bool hit(const ray& r, interval ray_t) const {
+        RT_STAT(aabb_tests);
         const point3& ray_orig = r.origin();
         const vec3&   ray_dir  = r.direction();
 
@@ -74,6 +76,12 @@ class aabb {
         else
             return y.size() > z.size() ? 1 : 2;
     }
+
+    // Surface area of the box, used as the cost measure of a BVH node
+    double surface_area() const {
+        auto dx = x.size(), dy = y.size(), dz = z.size();
+        return 2.0 * (dx*dy + dy*dz + dz*dx);
+    }
     
 
 private:
@@ -0,0 +1,263 @@
+#include "headers.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "pdf.h"
+#include "quad.h"
+#include "scene_loader.h"
+#include "sphere.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Benchmark suite, renders each built in scene with a fixed seed then times the intersection and
+// sampling routines on their own. Results are printed as a table and can be written as JSON to
+// track regressions between builds.
+
+using bench_clock = std::chrono::steady_clock;
+
+const unsigned int bench_seed = 1234;
+
+double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+struct scene_result {
+    std::string name;
+    double build_seconds;// parsing the scene, decoding its textures and building its bvh
+    double render_seconds;// tracing only
+    unsigned long long primary_rays;
+    unsigned long long secondary_rays;
+
+    double rays_per_second() const {
+        return (primary_rays + secondary_rays) / render_seconds;
+    }
+};
+
+struct micro_result {
+    std::string name;
+    double ns_per_op;
+    long long operations;
+};
+
+struct bench_options {
+    int image_width = 160;
+    int samples_per_pixel = 16;
+    int thread_count = int(std::thread::hardware_concurrency());
+    const char* json_file = nullptr;
+    bool run_scenes = true;
+    bool run_micro = true;
+};
+
+scene_result bench_scene(const std::string& name, const bench_options& options) {
+    scene_result result;
+    result.name = name;
+
+    seed_random(bench_seed);// scene construction draws random numbers too (perlin tables)
+    auto start = bench_clock::now();
+    scene loaded;
+    scene_loader loader;
+    if (!loader.load("scenes/" + name + ".scene", loaded))
+        std::exit(1);
+    result.build_seconds = seconds_since(start);// load waits for the textures decoding in the background
+
+    auto& cam = loaded.cam;
+    cam.image_width = options.image_width;
+    cam.samples_per_pixel = options.samples_per_pixel;
+    cam.thread_count = options.thread_count > 0 ? options.thread_count : 1;
+    cam.seed = bench_seed;
+    cam.show_progress = false;
+
+    start = bench_clock::now();
+    cam.render_image(loaded.world, loaded.lights);
+    result.render_seconds = seconds_since(start);
+
+    result.primary_rays = cam.primary_rays;
+    result.secondary_rays = cam.secondary_rays;
+    return result;
+}
+
+volatile double bench_sink = 0;// bench_micro adds its results here so the calls it times aren't optimised away
+
+// Runs op over the prepared inputs until at least min_seconds have passed
+template <typename Op>
+micro_result bench_micro(const std::string& name, size_t input_count, Op op, double min_seconds = 0.25) {
+    long long operations = 0;
+    double sink = 0;
+    auto start = bench_clock::now();
+    double elapsed;
+    do {
+        for (size_t i = 0; i < input_count; i++)
+            sink += op(i);
+        operations += input_count;
+        elapsed = seconds_since(start);
+    } while (elapsed < min_seconds);
+
+    bench_sink = bench_sink + sink;
+    return micro_result{ name, elapsed * 1e9 / operations, operations };
+}
+
+// Random rays from a shell around the origin aimed at points inside the unit cube
+std::vector<ray> make_rays(size_t count) {
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        auto origin = 4 * random_unit_vector();
+        auto target = vec3::random(-1, 1);
+        rays.push_back(ray(origin, target - origin, random_double()));
+    }
+    return rays;
+}
+
+std::vector<micro_result> run_micro_benchmarks() {
+    seed_random(bench_seed);
+    const size_t input_count = 1 << 14;
+    auto rays = make_rays(input_count);
+    std::vector<micro_result> results;
+    auto mat = shared_ptr<material>();
+
+    aabb box(point3(-1,-1,-1), point3(1,1,1));
+    results.push_back(bench_micro("aabb::hit", input_count, [&](size_t i) {
+        return double(box.hit(rays[i], interval(0.001, INF)));
+    }));
+
+    sphere ball(point3(0,0,0), 1, mat);
+    results.push_back(bench_micro("sphere::hit", input_count, [&](size_t i) {
+        hit_record rec;
+        return ball.hit(rays[i], interval(0.001, INF), rec) ? rec.t : 0.0;
+    }));
+
+    quad square(point3(-1,-1,0), vec3(2,0,0), vec3(0,2,0), mat);
+    results.push_back(bench_micro("quad::hit", input_count, [&](size_t i) {
+        hit_record rec;
+        return square.hit(rays[i], interval(0.001, INF), rec) ? rec.t : 0.0;
+    }));
+
+    // bvh over a grid of small spheres filling the same cube as the rays
+    hittable_list spheres;
+    for (int x = 0; x < 16; x++)
+        for (int y = 0; y < 16; y++)
+            for (int z = 0; z < 16; z++)
+                spheres.add(make_shared<sphere>(point3(-1 + (x + 0.5)/8, -1 + (y + 0.5)/8, -1 + (z + 0.5)/8), 0.04, mat));
+    bvh_node tree(spheres);
+    results.push_back(bench_micro("bvh_node::hit", input_count, [&](size_t i) {
+        hit_record rec;
+        return tree.hit(rays[i], interval(0.001, INF), rec) ? rec.t : 0.0;
+    }));
+
+    results.push_back(bench_micro("random_cosine_direction", input_count, [&](size_t i) {
+        return random_cosine_direction().z();
+    }));
+
+    results.push_back(bench_micro("random_unit_vector", input_count, [&](size_t i) {
+        return random_unit_vector().z();
+    }));
+
+    cosine_pdf cosine(vec3(0,1,0));
+    results.push_back(bench_micro("cosine_pdf::generate+value", input_count, [&](size_t i) {
+        return cosine.value(cosine.generate());
+    }));
+
+    hittable_list lights;
+    lights.add(make_shared<quad>(point3(343,554,332), vec3(-130,0,0), vec3(0,0,-105), mat));
+    lights.add(make_shared<sphere>(point3(190, 90, 190), 90, mat));
+    hittable_pdf light_pdf(lights, point3(278, 1, 278));
+    results.push_back(bench_micro("hittable_pdf::generate+value", input_count, [&](size_t i) {
+        return light_pdf.value(light_pdf.generate());
+    }));
+
+    return results;
+}
+
+void write_json(std::ostream& out, const bench_options& options,
+                const std::vector<scene_result>& scenes, const std::vector<micro_result>& micro) {
+    out << std::setprecision(9);
+    out << "{\n  \"seed\": " << bench_seed
+        << ",\n  \"image_width\": " << options.image_width
+        << ",\n  \"samples_per_pixel\": " << options.samples_per_pixel
+        << ",\n  \"threads\": " << options.thread_count
+        << ",\n  \"scenes\": [";
+    for (size_t i = 0; i < scenes.size(); i++) {
+        const auto& s = scenes[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << s.name
+            << "\", \"build_seconds\": " << s.build_seconds
+            << ", \"render_seconds\": " << s.render_seconds
+            << ", \"primary_rays\": " << s.primary_rays
+            << ", \"secondary_rays\": " << s.secondary_rays
+            << ", \"rays_per_second\": " << s.rays_per_second() << "}";
+    }
+    out << "\n  ],\n  \"micro\": [";
+    for (size_t i = 0; i < micro.size(); i++) {
+        const auto& m = micro[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << m.name
+            << "\", \"ns_per_op\": " << m.ns_per_op
+            << ", \"operations\": " << m.operations << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+bool parse_options(int argc, char* argv[], bench_options& options) {
+    for (int i = 1; i < argc; i++) {
+        auto option = argv[i];
+        if (std::strcmp(option, "--scenes-only") == 0) { options.run_micro = false; continue; }
+        if (std::strcmp(option, "--micro-only") == 0)  { options.run_scenes = false; continue; }
+        if (i + 1 >= argc)
+            return false;
+        auto value = argv[++i];
+        if (std::strcmp(option, "--width") == 0)        options.image_width = std::atoi(value);
+        else if (std::strcmp(option, "--spp") == 0)     options.samples_per_pixel = std::atoi(value);
+        else if (std::strcmp(option, "--threads") == 0) options.thread_count = std::atoi(value);
+        else if (std::strcmp(option, "--json") == 0)    options.json_file = value;
+        else return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "Usage: raytracing_bench [--width n] [--spp n] [--threads n] [--json file] [--scenes-only | --micro-only]\n";
+        return 1;
+    }
+
+    std::vector<scene_result> scenes;
+    if (options.run_scenes) {
+        const char* names[] = { "cornell_box", "bouncing_spheres", "perlin_spheres", "quads", "earth", "cornell_smoke" };
+        std::cout << std::left << std::setw(20) << "scene" << std::right
+                  << std::setw(12) << "build s" << std::setw(12) << "render s" << std::setw(14) << "primary"
+                  << std::setw(14) << "secondary" << std::setw(14) << "Mrays/s" << "\n";
+        for (auto name : names) {
+            scenes.push_back(bench_scene(name, options));
+            const auto& s = scenes.back();
+            std::cout << std::left << std::setw(20) << s.name << std::right << std::fixed << std::setprecision(4)
+                      << std::setw(12) << s.build_seconds << std::setw(12) << s.render_seconds
+                      << std::setw(14) << s.primary_rays << std::setw(14) << s.secondary_rays
+                      << std::setw(14) << s.rays_per_second() / 1e6 << "\n" << std::flush;
+        }
+        std::cout << "\n";
+    }
+
+    std::vector<micro_result> micro;
+    if (options.run_micro) {
+        micro = run_micro_benchmarks();
+        std::cout << std::left << std::setw(32) << "routine" << std::right << std::setw(12) << "ns/op" << "\n";
+        for (const auto& m : micro)
+            std::cout << std::left << std::setw(32) << m.name << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(12) << m.ns_per_op << "\n";
+    }
+
+    if (options.json_file != nullptr) {
+        std::ofstream out(options.json_file);
+        if (!out) {
+            std::cerr << "ERROR: Could not open output file '" << options.json_file << "'.\n";
+            return 1;
+        }
+        write_json(out, options, scenes, micro);
+    }
+}
@@ -6,6 +6,7 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "stats.h"
 
 #include <algorithm>
 
@@ -17,9 +18,102 @@ class bvh_node : public hittable {
     }
     // Build the bounding volume heirarchy of the fitting the span of the source objects
     bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
+        build(objects, start, end);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(bvh_nodes_visited);
+        if (!bbox.hit(r, ray_t))//does it intersect with the bounding box
+            return false;
+
+        bool hit_childA = childA->hit(r, ray_t, rec);
+
+        if(childB==nullptr)
+            return hit_childA;//doesn't check childB when only one child node
+
+        bool hit_childB = childB->hit(r, interval(ray_t.min, hit_childA ? rec.t : ray_t.max), rec);
+
+        return hit_childA || hit_childB;
+    }
+    bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(bvh_nodes_visited);
+        if (!bbox.hit(r, ray_t))
+            return false;
+
+        bool hit_childA = childA->hit_surface(r, ray_t, rec);
+        if (childB == nullptr)
+            return hit_childA;
+        bool hit_childB = childB->hit_surface(r, interval(ray_t.min, hit_childA ? rec.t : ray_t.max), rec);
+        return hit_childA || hit_childB;
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        RT_STAT(bvh_nodes_visited);
+        if (!bbox.hit(r, ray_t))
+            return 1;
+        double result = childA->transmittance(r, ray_t);
+        if (childB == nullptr || result <= 0)
+            return result;
+        return result * childB->transmittance(r, ray_t);
+    }
+
+    // return the bounding box of the node
+    aabb bounding_box() const override { return bbox; }
+
+    // every leaf the ray's box test lets through, not just the closest
+    bool surface_crossings(const ray& r, interval ray_t, std::vector<double>& crossings) const override {
+        RT_STAT(bvh_nodes_visited);
+        if (!bbox.hit(r, ray_t))
+            return true;
+        if (!childA->surface_crossings(r, ray_t, crossings))
+            return false;
+        return childB == nullptr || childB->surface_crossings(r, ray_t, crossings);
+    }
+
+    // Refit the bounds bottom-up after objects have moved, keeping the tree topology.
+    // Any subtree whose surface area has grown past rebuild_threshold times its area when it
+    // was built has degraded too far to be worth refitting and is rebuilt from its objects.
+    void refit() override {
+        childA->refit();
+        if (childB != nullptr)
+            childB->refit();
+
+        bbox = childB == nullptr ? childA->bounding_box() : aabb(childA->bounding_box(), childB->bounding_box());
+
+        if (!is_leaf && bbox.surface_area() > rebuild_threshold * build_area) {
+            std::vector<shared_ptr<hittable>> objects;
+            collect_objects(objects);
+            build(objects, 0, objects.size());
+        }
+    }
+
+    bool flatten(scene_writer& writer) const override {
+        if (!childA->flatten(writer))
+            return false;
+        return childB == nullptr || childB->flatten(writer);
+    }
+
+    void measure(memory_usage& usage) const override {
+        usage.acceleration += sizeof(bvh_node);
+        measure_object(childA, usage);
+        measure_object(childB, usage);
+    }
+
+    // Ratio of refitted to built surface area before a subtree is rebuilt
+    static inline double rebuild_threshold = 2.0;
+
+  private:
+    shared_ptr<hittable> childA;
+    shared_ptr<hittable> childB;
+    aabb bbox;
+    double build_area;// surface area of the node when it was last built
+    bool is_leaf;// children are the scene objects rather than bvh nodes
+
+    void build(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
         bbox = aabb::empty;
         for (size_t object_index=start; object_index < end; object_index++)
             bbox = aabb(bbox, objects[object_index]->bounding_box());
+        build_area = bbox.surface_area();
 
         int axis = bbox.longest_axis();
         auto comparator = (axis == 0) ? box_x_compare
@@ -27,6 +121,7 @@ class bvh_node : public hittable {
                                       : box_z_compare;//pick the comparator based on the chosen axis
 
         size_t object_span = end - start;//length of the list
+        is_leaf = object_span <= 2;
 
         if (object_span == 1) {//1 object in the list, 
             childA = objects[start];// set childA to a leaf node
@@ -44,26 +139,17 @@ class bvh_node : public hittable {
         }
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox.hit(r, ray_t))//does it intersect with the bounding box
-            return false;
-
-        bool hit_childA = childA->hit(r, ray_t, rec);
-
-        if(childB==nullptr)
-            return hit_childA;//doesn't check childB when only one child node
-
-        bool hit_childB = childB->hit(r, interval(ray_t.min, hit_childA ? rec.t : ray_t.max), rec);
-
-        return hit_childA || hit_childB;
+    // gathers the scene objects in the leaves of this subtree
+    void collect_objects(std::vector<shared_ptr<hittable>>& objects) const {
+        if (is_leaf) {
+            objects.push_back(childA);
+            if (childB != nullptr)
+                objects.push_back(childB);
+            return;
+        }
+        std::static_pointer_cast<bvh_node>(childA)->collect_objects(objects);
+        std::static_pointer_cast<bvh_node>(childB)->collect_objects(objects);
     }
-    // return the bounding box of the node
-    aabb bounding_box() const override { return bbox; }
-
-  private:
-    shared_ptr<hittable> childA;
-    shared_ptr<hittable> childB;
-    aabb bbox;
 
     static bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index) {//takes the axis to compare the bounding boxes with
         auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
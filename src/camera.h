@@ -6,6 +6,32 @@
 #include "hittable.h"
 #include "pdf.h"
 #include "material.h"
+#include "hittable_list.h"
+#include "stats.h"
+#include "image_output.h"
+#include "denoise.h"
+#include "checkpoint.h"
+#include "tile_stream.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Features of the first hit in each pixel, averaged over the pixel's samples
+struct aov_buffers {
+    std::vector<colour> albedo;    // Surface colour, the emission for lights and the background for misses
+    std::vector<colour> normal;    // World space normal facing the camera, zero for misses
+    std::vector<float>  depth;     // Distance along the camera ray, zero for misses
+    std::vector<float>  object_id; // Primitive hit by the pixel's first sample, -1 for misses
+};
 
 class camera {
   public:
@@ -22,30 +48,275 @@ class camera {
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    int thread_count = 1;      // Threads rendering tiles in parallel
+    unsigned int seed = 0;     // Base random seed, each tile is seeded from it so the image doesn't depend on the thread count
+    uint64_t scene_hash = 0;   // Hash of the scene file's text, a checkpoint is only resumed by a render of the same scene
+    bool show_progress = true; // Print the tiles remaining to the console
+    std::string profile_prefix;// When set, the time, samples and bounce depth of each pixel are written to <prefix>_time.pfm,
+                               // <prefix>_samples.pfm, <prefix>_bounces.pfm and a false colour <prefix>_heatmap.ppm of the time
+    bool record_aovs = false;  // Fill aovs with the first hit features of each pixel during the render
+    std::string aov_prefix;    // When set, the aovs are also written to <prefix>_albedo.pfm, <prefix>_normal.pfm,
+                               // <prefix>_depth.pfm and <prefix>_id.pfm
+    aov_buffers aovs;          // First hit features from the last render
+    bool denoise = false;      // Filter the image with the edge aware denoiser guided by the aovs before writing it
+
+    int pass_samples = 0;      // When above zero the image is refined in passes of this many samples per pixel until it
+                               // has samples_per_pixel, accumulating into a buffer that can be checkpointed
+    std::string checkpoint_file;    // The accumulation is saved here between passes, and resumed from if it was made with the same settings
+    double checkpoint_seconds = 60; // Minimum wall clock time between checkpoints, the finished image is always saved
+    std::string snapshot_file;      // Where the current image is written after the pass in which a snapshot was requested
+    double time_budget = 0;    // When above zero, passes of pass_samples (or 1) samples per pixel are rendered until this many
+                               // seconds have passed instead of stopping at samples_per_pixel. The last pass stops when the
+                               // time is up, so pixels in the tiles it finished have one more pass of samples than the rest
+
+    // Crop window in pixels of the full image_width wide frame, x0 <= x < x1 and y0 <= y < y1. Only rays for the
+    // pixels inside it are traced and the image is just the window, the whole frame when it's empty. Pixels match the
+    // uncropped render exactly when the window edges are on the tile_size grid, other tiles it cuts are sampled afresh
+    int crop_x0 = 0, crop_y0 = 0, crop_x1 = 0, crop_y1 = 0;
+
+    tile_callback on_tile;     // Called with each tile as soon as it's finished, from the render threads but never two at once
+    std::function<void(int)> on_pass;// Called by render_image with the number of passes done after each one, between passes
+
+    bool wavefront = false;    // Trace each tile's samples together a bounce at a time, sorting rays by direction and hits by
+                               // material between bounces (see wavefront.h), instead of one sample's whole path at a time.
+                               // The image converges to the same result but the samples draw different random numbers
+    static const int wavefront_paths = 16384; // Most paths traced together by each thread, a whole number of pixels' worth
+
+    static const int tile_size = 32;  // Width and height in pixels of the square tiles handed to each thread
+
+    // Rays traced by the last render
+    unsigned long long primary_rays = 0;   // Camera rays
+    unsigned long long secondary_rays = 0; // Scattered rays after the first bounce
+
+    // Ask a progressive render for a snapshot of its current image, safe to call from a signal handler
+    static void request_snapshot() {
+        snapshot_requested = true;
+    }
+
     void render(const hittable& world, const hittable& lights) {
-        initialize();
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";//formatting the .ppm file
-        for (int j = 0; j < image_height; j++) {
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;//writes to the console
-            for (int i = 0; i < image_width; i++) {
-                colour pixel_color(0,0,0);
-                for (int s_j = 0; s_j < sqrt_spp; s_j++) {
-                    for (int s_i = 0; s_i < sqrt_spp; s_i++) {
-                        ray r = get_ray(i, j, s_i, s_j);
-                        pixel_color += ray_colour(r, max_depth, world, lights);
-                    }
-                }
-                write_color(std::cout, pixel_samples_scale * pixel_color);
+        render(world, lights, std::cout);
+    }
+
+    // Passes needed to reach samples_per_pixel, each adds the same number of samples to every pixel
+    int pass_count() const {
+        int sqrt_pass = std::max(1, int(std::sqrt(requested_pass_samples())));
+        int samples_per_pass = sqrt_pass * sqrt_pass;
+        return pass_samples > 0 ? std::max(1, (samples_per_pixel + samples_per_pass - 1) / samples_per_pass) : 1;
+    }
+
+    // Traces a single pass on its own for a worker of a distributed render, see distributed.h. The
+    // samples are left in the returned buffer for the coordinator to add to the other passes.
+    const render_checkpoint& render_pass(const hittable& world, const hittable& lights, int pass) {
+        initialize(lights);
+        pixel_time.clear();
+        pixel_depth.clear();
+        aovs = aov_buffers();
+        progress.reset(region_x0, region_y0, region_width, region_height, seed, sqrt_spp * sqrt_spp);
+        aov_pass = -1;
+        render_tiles(world, lights, pass);
+        progress.passes = 1;
+        return progress;
+    }
+
+    // Samples each pixel of the last render has, which varies when it ran out of time_budget
+    const std::vector<float>& samples_taken() const {
+        return progress.sample_counts;
+    }
+
+    // render the image as a .ppm to the given output stream
+    void render(const hittable& world, const hittable& lights, std::ostream& out) {
+        auto framebuffer = render_image(world, lights);
+        write_image(out, framebuffer);
+        if (show_progress)
+            std::clog << "\rDone.                 \n";
+#ifdef RT_ENABLE_STATS
+        render_stats::take_totals().print(std::clog);
+#endif
+    }
+
+    // render the crop window into the matching pixels of a buffer of the whole frame, which is resized to
+    // image_width by the frame's height if it's another size, pixels outside the window are left as they are
+    void render_into(const hittable& world, const hittable& lights, std::vector<colour>& frame) {
+        auto window = render_image(world, lights);
+        frame.resize(size_t(image_width) * image_height);
+        for (int j = 0; j < region_height; j++)
+            std::copy_n(window.begin() + size_t(j) * region_width, region_width,
+                        frame.begin() + size_t(region_y0 + j) * image_width + region_x0);
+    }
+
+    // render the image to linear colours in rows from the top, rendered_height() rows of rendered_width()
+    std::vector<colour> render_image(const hittable& world, const hittable& lights) {
+        auto render_start = std::chrono::steady_clock::now();
+        deadline = render_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_budget));
+        begin_render(lights, true);
+        int pass_count = this->pass_count();
+        auto last_checkpoint = std::chrono::steady_clock::now();
+        bool budgeted = time_budget > 0;
+        while (budgeted || progress.passes < pass_count) {
+            if (budgeted && progress.passes > aov_pass && std::chrono::steady_clock::now() >= deadline)
+                break;
+            if (!render_tiles(world, lights, progress.passes))
+                break;// out of time part way through, the pass isn't counted so it isn't checkpointed
+            progress.passes++;
+
+            auto now = std::chrono::steady_clock::now();
+            bool checkpoint_due = progress.passes == pass_count
+                               || std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_seconds;
+            if (!checkpoint_file.empty() && checkpoint_due) {
+                progress.save(checkpoint_file);
+                last_checkpoint = now;
+            }
+            if (snapshot_requested.exchange(false))
+                write_snapshot();
+            if (on_pass)
+                on_pass(progress.passes);
+        }
+
+        if (budgeted)
+            report_samples(std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count());
+        return finish_render();
+    }
+
+    // Renders one image per camera of the same world and lights. The tiles of every camera are
+    // shared out to a single pool of threads, so all of them are tracing the one scene at once
+    // rather than each camera starting its own threads and warming the caches again. Each image
+    // matches what the camera's render_image would give; checkpoints and time budgets aren't
+    // used. The pool takes its thread_count and show_progress from the first camera.
+    static std::vector<std::vector<colour>> render_batch(const std::vector<camera*>& cameras, const hittable& world, const hittable& lights) {
+        std::vector<tile_grid> grids;
+        for (auto cam : cameras) {
+            cam->begin_render(lights, false);
+            grids.push_back(cam->window_tiles());
+        }
+
+        // each round traces the next pass of every camera with passes left, so no two threads add to the same pixel
+        while (true) {
+            std::vector<std::pair<size_t, int>> work;// camera and tile of the crop window
+            for (size_t c = 0; c < cameras.size(); c++) {
+                if (cameras[c]->progress.passes < cameras[c]->pass_count())
+                    for (int k = 0; k < grids[c].window_tile_count; k++)
+                        work.emplace_back(c, k);
             }
+            if (work.empty())
+                break;
+
+            std::atomic<size_t> next_item(0);
+            std::mutex output_mutex;
+            size_t items_remaining = work.size();
+            bool show_progress = cameras[0]->show_progress;
+
+            auto worker = [&]() {
+                std::vector<float> tile_pixels;
+                for (size_t item = next_item++; item < work.size(); item = next_item++) {
+                    auto cam = cameras[work[item].first];
+                    cam->render_window_tile(grids[work[item].first], cam->progress.passes, work[item].second, world, lights, tile_pixels, output_mutex);
+
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    items_remaining--;
+                    if (show_progress)
+                        std::clog << "\rBatch tiles remaining: " << items_remaining << ' ' << std::flush;
+                }
+#ifdef RT_ENABLE_STATS
+                render_stats::merge_local();
+#endif
+            };
+
+            std::vector<std::thread> threads;
+            for (int t = 1; t < cameras[0]->thread_count; t++)
+                threads.emplace_back(worker);
+            worker();
+            for (auto& thread : threads)
+                thread.join();
+
+            for (auto cam : cameras)
+                if (cam->progress.passes < cam->pass_count())
+                    cam->progress.passes++;
+        }
+
+        std::vector<std::vector<colour>> images;
+        for (auto cam : cameras)
+            images.push_back(cam->finish_render());
+        return images;
+    }
+
+    // write an image from render_image or render_batch as a .ppm
+    void write_image(std::ostream& out, const std::vector<colour>& framebuffer) const {
+        out << "P3\n" << region_width << ' ' << region_height << "\n255\n";//formatting the .ppm file
+        for (const auto& pixel_colour : framebuffer)
+            write_color(out, pixel_colour);
+    }
+
+    // Memory the buffers of a render with the current settings take: the samples accumulated in
+    // each pixel of the crop window, the resolved (and denoised) image, the aovs and profile when
+    // they are asked for, and each thread's path batch when rendering as a wavefront
+    size_t framebuffer_bytes() const {
+        auto frame = window();
+        size_t per_pixel = sizeof(colour) + sizeof(float) + sizeof(colour) * (denoise ? 2 : 1);
+        if (!profile_prefix.empty())
+            per_pixel += 2 * sizeof(float);
+        if (record_aovs || denoise || !aov_prefix.empty())
+            per_pixel += 2 * sizeof(colour) + 2 * sizeof(float);
+        size_t total = size_t(frame.width) * frame.height * per_pixel;
+        if (wavefront)
+            total += size_t(std::max(1, thread_count)) * wavefront_paths * path_batch::bytes_per_path;
+        return total;
+    }
+
+    // size of the last render's image, the crop window if there was one
+    int rendered_width() const {
+        return region_width;
+    }
+
+    int rendered_height() const {
+        return region_height;
+    }
+
+  private:
+    // Sets up the buffers of a render, resuming from the checkpoint file if allowed
+    void begin_render(const hittable& lights, bool resume) {
+        initialize(lights);
+        size_t pixel_count = size_t(region_width) * region_height;
+        primary_rays = secondary_rays = 0;
+        bool profiling = !profile_prefix.empty();
+        pixel_time.assign(profiling ? pixel_count : 0, 0.0f);
+        pixel_depth.assign(profiling ? pixel_count : 0, 0.0f);
+        bool recording_aovs = record_aovs || denoise || !aov_prefix.empty();
+        aovs.albedo.assign(recording_aovs ? pixel_count : 0, colour(0,0,0));
+        aovs.normal.assign(recording_aovs ? pixel_count : 0, colour(0,0,0));
+        aovs.depth.assign(recording_aovs ? pixel_count : 0, 0.0f);
+        aovs.object_id.assign(recording_aovs ? pixel_count : 0, -1.0f);
+
+        if (resume)
+            start_accumulation();
+        else
+            progress.reset(region_x0, region_y0, region_width, region_height, seed, sqrt_spp * sqrt_spp);
+        aov_pass = progress.passes;// the aovs come from the first pass this render traces
+    }
+
+    // The finished image, denoised if asked, with the profile and aovs written out
+    std::vector<colour> finish_render() {
+        bool profiling = !pixel_time.empty();
+        auto framebuffer = resolve();
+        if (denoise) {
+            denoiser filter;
+            filter.thread_count = thread_count;
+            framebuffer = filter.denoise(framebuffer, aovs.albedo, aovs.normal, aovs.depth, region_width, region_height);
         }
-        std::clog << "\rDone.                 \n";
+        if (profiling)
+            write_profile();
+        if (!aov_prefix.empty())
+            write_aovs();
+        return framebuffer;
     }
 
   private:
     int    image_height;
+    int    region_x0, region_y0;        // Top left of the crop window clamped to the image, 0, 0 without one
+    int    region_width, region_height; // Size of the crop window, the image size without one
     double pixel_samples_scale;  // Color scale factor for a sum of pixel samples
     int    sqrt_spp;             // Square root of number of samples per pixel
     double recip_sqrt_spp;       // 1 / sqrt_spp
+    double pixel_spread;         // Angle a pixel covers from the camera, the spread of the camera rays' cones
     point3 camera_center;
     point3 pixel_origin; // Location of pixel 0, 0
     vec3   pixel_delta_u; //horizontal pixel offset
@@ -53,13 +324,48 @@ class camera {
     vec3   u, v, w;       // Camera frame basis vectors
     vec3   defocus_disk_u;       // Defocus disk horizontal radius
     vec3   defocus_disk_v;       // Defocus disk vertical radius
+    bool   sample_lights;        // Whether there are lights to importance sample
+
+    render_checkpoint progress;  // Samples accumulated in each pixel, over all passes so far
+    int    aov_pass;             // Pass in which the aovs are recorded
+    std::chrono::steady_clock::time_point deadline;// End of the time budget
+    static inline std::atomic<bool> snapshot_requested{false};
+
+    // Per pixel cost of the last render, only filled when profiling, the samples taken are in progress
+    std::vector<float> pixel_time;    // Wall clock nanoseconds spent on the pixel
+    std::vector<float> pixel_depth;   // Total bounces of the pixel's samples
 
-    void initialize() {
+    // First hit features of a single camera ray
+    struct first_hit {
+        colour albedo;
+        vec3 normal;
+        double depth = 0;
+        int object_id = -1;
+    };
+
+    struct ray_count {
+        unsigned long long primary = 0;
+        unsigned long long secondary = 0;
+    };
+
+    static ray_count& ray_counts() {// counted per thread so the hot path doesn't share a counter
+        thread_local ray_count counts;
+        return counts;
+    }
+
+    void initialize(const hittable& lights) {
+        // An empty light list can't be sampled, so only the material's scattering pdf is used
+        auto light_list = dynamic_cast<const hittable_list*>(&lights);
+        sample_lights = light_list == nullptr || !light_list->hittable_objects.empty();
        
-        image_height = int(image_width / aspect_ratio);
-        image_height = (image_height < 1) ? 1 : image_height; // calculate the image height, and ensure that it's at least 1.
+        auto frame = window();
+        image_height = frame.image_height;
+        region_x0 = frame.x0;
+        region_y0 = frame.y0;
+        region_width = frame.width;
+        region_height = frame.height;
         
-        sqrt_spp = int(std::sqrt(samples_per_pixel));
+        sqrt_spp = int(std::sqrt(requested_pass_samples()));
         pixel_samples_scale = 1.0 / (sqrt_spp * sqrt_spp);
         recip_sqrt_spp = 1.0 / sqrt_spp;
 
@@ -82,6 +388,7 @@ class camera {
 
         pixel_delta_u = viewport_u / image_width;
         pixel_delta_v = viewport_v / image_height;
+        pixel_spread = viewport_height / image_height / focus_dist;
 
         // Calculate the location of the upper left pixel.
         auto viewport_upper_left = camera_center - focus_dist*w - viewport_u/2 - viewport_v/2;
@@ -93,6 +400,498 @@ class camera {
         defocus_disk_v = v * defocus_radius;
     }
 
+    struct frame_window {
+        int image_height;
+        int x0, y0, width, height;// crop window clamped to the image, the whole image without one
+    };
+
+    frame_window window() const {
+        frame_window frame;
+        frame.image_height = int(image_width / aspect_ratio);
+        frame.image_height = (frame.image_height < 1) ? 1 : frame.image_height; // calculate the image height, and ensure that it's at least 1.
+
+        bool cropped = crop_x1 > crop_x0 && crop_y1 > crop_y0;
+        frame.x0 = cropped ? std::clamp(crop_x0, 0, image_width - 1) : 0;
+        frame.y0 = cropped ? std::clamp(crop_y0, 0, frame.image_height - 1) : 0;
+        frame.width = cropped ? std::clamp(crop_x1, frame.x0 + 1, image_width) - frame.x0 : image_width;
+        frame.height = cropped ? std::clamp(crop_y1, frame.y0 + 1, frame.image_height) - frame.y0 : frame.image_height;
+        return frame;
+    }
+
+    // Samples per pixel asked of each pass, rounded down to a square for stratification
+    int requested_pass_samples() const {
+        if (time_budget > 0)
+            return pass_samples > 0 ? pass_samples : 1;
+        if (pass_samples > 0)
+            return std::min(pass_samples, samples_per_pixel);
+        return samples_per_pixel;
+    }
+
+    // Index in the render's buffers of pixel i, j of the frame
+    size_t region_index(int i, int j) const {
+        return size_t(j - region_y0) * region_width + (i - region_x0);
+    }
+
+    // The average of each pixel's samples in the x0 <= x < x1, y0 <= y < y1 part of a tile as rgb floats
+    void resolve_tile(int x0, int y0, int x1, int y1, std::vector<float>& pixels) const {
+        pixels.resize(size_t(x1 - x0) * (y1 - y0) * 3);
+        auto out = pixels.begin();
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                auto average = progress.average(region_index(i, j));
+                *out++ = float(average.x());
+                *out++ = float(average.y());
+                *out++ = float(average.z());
+            }
+        }
+    }
+
+    // Resumes from the checkpoint file if it continues this render, otherwise starts from no samples
+    void start_accumulation() {
+        int samples_per_pass = sqrt_spp * sqrt_spp;
+        if (!checkpoint_file.empty() && progress.load(checkpoint_file)) {
+            if (progress.matches(region_x0, region_y0, region_width, region_height, seed, samples_per_pass, settings_hash())) {
+                if (show_progress)
+                    std::clog << "Resuming from pass " << progress.passes << " of '" << checkpoint_file << "'.\n";
+                return;
+            }
+            std::cerr << "ERROR: Checkpoint '" << checkpoint_file << "' was made with different render settings, starting over.\n";
+        }
+        progress.reset(region_x0, region_y0, region_width, region_height, seed, samples_per_pass, settings_hash());
+    }
+
+    // Hash of the scene and of the camera and integrator settings that change what the samples
+    // trace, saved with checkpoints
+    uint64_t settings_hash() const {
+        double settings[] = {
+            double(image_width), double(image_height), double(max_depth), double(sqrt_spp), double(wavefront), fov,
+            cam_center.x(), cam_center.y(), cam_center.z(), look_point.x(), look_point.y(), look_point.z(),
+            vup.x(), vup.y(), vup.z(), defocus_angle, focus_dist,
+            background_colour.x(), background_colour.y(), background_colour.z(),
+        };
+        return fnv1a(settings, sizeof(settings), fnv1a(&scene_hash, sizeof(scene_hash)));
+    }
+
+    // The average of each pixel's samples
+    std::vector<colour> resolve() const {
+        std::vector<colour> framebuffer(progress.accumulation.size());
+        for (size_t i = 0; i < framebuffer.size(); i++)
+            framebuffer[i] = progress.average(i);
+        return framebuffer;
+    }
+
+    void write_snapshot() const {
+        std::ofstream out(snapshot_file);
+        if (!out) {
+            std::cerr << "ERROR: Could not open snapshot file '" << snapshot_file << "'.\n";
+            return;
+        }
+        write_image(out, resolve());
+        if (show_progress)
+            std::clog << "\rWrote snapshot of pass " << progress.passes << " to '" << snapshot_file << "'.\n";
+    }
+
+    // Tiles of the crop window. Tiles are numbered on the grid of the whole frame, so a tile is
+    // seeded the same whether or not the image is cropped.
+    struct tile_grid {
+        int tiles_x, tile_count;           // Whole frame
+        int first_x, first_y;              // Grid position of the window's top left tile
+        int window_tiles_x, window_tile_count;
+    };
+
+    tile_grid window_tiles() const {
+        tile_grid grid;
+        grid.tiles_x = (image_width + tile_size - 1) / tile_size;
+        grid.tile_count = grid.tiles_x * ((image_height + tile_size - 1) / tile_size);
+        grid.first_x = region_x0 / tile_size;
+        grid.first_y = region_y0 / tile_size;
+        grid.window_tiles_x = (region_x0 + region_width - 1) / tile_size - grid.first_x + 1;
+        grid.window_tile_count = grid.window_tiles_x * ((region_y0 + region_height - 1) / tile_size - grid.first_y + 1);
+        return grid;
+    }
+
+    // Renders the part of the k-th window tile inside the crop window, output_mutex is held while
+    // the tile is handed to on_tile and its rays are counted
+    void render_window_tile(const tile_grid& grid, int pass, int k, const hittable& world, const hittable& lights,
+                            std::vector<float>& tile_pixels, std::mutex& output_mutex) {
+        int tile_x = grid.first_x + k % grid.window_tiles_x, tile_y = grid.first_y + k / grid.window_tiles_x;
+        int x0 = std::max(tile_x * tile_size, region_x0), x1 = std::min((tile_x + 1) * tile_size, region_x0 + region_width);
+        int y0 = std::max(tile_y * tile_size, region_y0), y1 = std::min((tile_y + 1) * tile_size, region_y0 + region_height);
+
+        auto counts_before = ray_counts();
+        render_tile(pass, tile_y * grid.tiles_x + tile_x, grid.tile_count, x0, y0, x1, y1, world, lights);
+        if (on_tile)
+            resolve_tile(x0, y0, x1, y1, tile_pixels);
+
+        std::lock_guard<std::mutex> lock(output_mutex);
+        if (on_tile)
+            on_tile(tile_block{ x0, y0, x1 - x0, y1 - y0, image_width, image_height, pass, tile_pixels.data() });
+        primary_rays += ray_counts().primary - counts_before.primary;
+        secondary_rays += ray_counts().secondary - counts_before.secondary;
+    }
+
+    // Returns false if the time budget ran out before every tile was rendered
+    bool render_tiles(const hittable& world, const hittable& lights, int pass) {
+        // Threads take the next tile until there are none left
+        auto grid = window_tiles();
+        std::atomic<int> next_tile(0);
+        std::mutex progress_mutex;
+        int tiles_remaining = grid.window_tile_count;
+        bool can_stop = time_budget > 0 && pass > aov_pass;// every pixel gets at least the first pass
+
+        auto worker = [&]() {
+            std::vector<float> tile_pixels;
+            for (int k = next_tile++; k < grid.window_tile_count; k = next_tile++) {
+                if (can_stop && std::chrono::steady_clock::now() >= deadline)
+                    break;
+                render_window_tile(grid, pass, k, world, lights, tile_pixels, progress_mutex);
+
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                tiles_remaining--;
+                if (show_progress && (pass_samples > 0 || time_budget > 0))
+                    std::clog << "\rPass " << pass + 1 << ", tiles remaining: " << tiles_remaining << ' ' << std::flush;
+                else if (show_progress)
+                    std::clog << "\rTiles remaining: " << tiles_remaining << ' ' << std::flush;//writes to the console
+            }
+#ifdef RT_ENABLE_STATS
+            render_stats::merge_local();
+#endif
+        };
+
+        std::vector<std::thread> threads;
+        for (int t = 1; t < thread_count; t++)
+            threads.emplace_back(worker);
+        worker();// the calling thread renders too
+        for (auto& thread : threads)
+            thread.join();
+        return tiles_remaining == 0;
+    }
+
+    void report_samples(double seconds) const {
+        auto range = std::minmax_element(progress.sample_counts.begin(), progress.sample_counts.end());
+        double total = 0;
+        for (auto count : progress.sample_counts)
+            total += count;
+        std::clog << "\rReached " << *range.first << " to " << *range.second << " samples per pixel ("
+                  << total / progress.sample_counts.size() << " on average) in " << seconds << "s of a "
+                  << time_budget << "s budget.\n";
+    }
+
+    void render_tile(int pass, int tile, int tile_count, int x0, int y0, int x1, int y1, const hittable& world, const hittable& lights) {
+        // every tile of every pass gets its own seed, the first pass is seeded as a single pass render
+        seed_random(seed ^ (unsigned int)((unsigned(pass) * tile_count + tile) * 2654435761u));
+        if (wavefront) {
+            render_tile_wavefront(pass, x0, y0, x1, y1, world, lights);
+            return;
+        }
+
+        int samples = sqrt_spp * sqrt_spp;
+        bool profiling = !pixel_time.empty();
+        bool recording_aovs = !aovs.albedo.empty() && pass == aov_pass;
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                std::chrono::steady_clock::time_point start;
+                if (profiling)// only read the clock when the time is kept
+                    start = std::chrono::steady_clock::now();
+                auto bounces_before = ray_counts().secondary;
+
+                colour pixel_color(0,0,0);
+                first_hit pixel_features;
+                for (int s_j = 0; s_j < sqrt_spp; s_j++) {
+                    for (int s_i = 0; s_i < sqrt_spp; s_i++) {
+                        ray r = get_ray(i, j, s_i, s_j);
+                        if (!recording_aovs) {
+                            pixel_color += ray_colour(r, ray_cone{ 0, pixel_spread }, max_depth, world, lights);
+                            continue;
+                        }
+                        first_hit features;
+                        pixel_color += ray_colour(r, ray_cone{ 0, pixel_spread }, max_depth, world, lights, &features);
+                        pixel_features.albedo += features.albedo;
+                        pixel_features.normal += features.normal;
+                        pixel_features.depth += features.depth;
+                        if (s_i == 0 && s_j == 0)
+                            pixel_features.object_id = features.object_id;
+                    }
+                }
+                auto index = region_index(i, j);
+                progress.accumulation[index] += pixel_color;
+                progress.sample_counts[index] += samples;
+
+                if (recording_aovs) {
+                    aovs.albedo[index] = pixel_samples_scale * pixel_features.albedo;
+                    aovs.normal[index] = pixel_samples_scale * pixel_features.normal;
+                    aovs.depth[index] = float(pixel_samples_scale * pixel_features.depth);
+                    aovs.object_id[index] = float(pixel_features.object_id);
+                }
+
+                if (profiling) {
+                    pixel_time[index] += float(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+                    pixel_depth[index] += float(ray_counts().secondary - bounces_before);
+                }
+            }
+        }
+    }
+
+    // render_tile for the wavefront integrator, the tile's pixels are traced in waves of up to
+    // wavefront_paths samples
+    void render_tile_wavefront(int pass, int x0, int y0, int x1, int y1, const hittable& world, const hittable& lights) {
+        int samples = sqrt_spp * sqrt_spp;
+        bool profiling = !pixel_time.empty();
+        bool recording_aovs = !aovs.albedo.empty() && pass == aov_pass;
+        thread_local path_batch paths;
+        thread_local std::vector<first_hit> features;
+
+        int width = x1 - x0, pixel_total = width * (y1 - y0);
+        int pixels_per_wave = std::max(1, wavefront_paths / samples);
+        for (int first = 0; first < pixel_total; first += pixels_per_wave) {
+            std::chrono::steady_clock::time_point start;
+            if (profiling)
+                start = std::chrono::steady_clock::now();
+            int pixel_count = std::min(pixels_per_wave, pixel_total - first);
+            paths.resize(pixel_count * samples);
+            if (recording_aovs)
+                features.assign(pixel_count * samples, first_hit());
+
+            // generate: the camera rays of every sample, in the same order as render_tile
+            paths.active.clear();
+            for (int p = 0; p < pixel_count; p++) {
+                int i = x0 + (first + p) % width, j = y0 + (first + p) / width;
+                for (int s_j = 0; s_j < sqrt_spp; s_j++) {
+                    for (int s_i = 0; s_i < sqrt_spp; s_i++) {
+                        int slot = p * samples + s_j * sqrt_spp + s_i;
+                        paths.start(slot, get_ray(i, j, s_i, s_j), 0, pixel_spread);
+                        paths.active.push_back(slot);
+                    }
+                }
+            }
+
+            for (int depth = max_depth; depth > 0 && !paths.active.empty(); depth--) {
+                extend_paths(paths, depth, world, recording_aovs ? features.data() : nullptr);
+                shade_paths(paths, depth, world, lights, recording_aovs ? features.data() : nullptr);
+            }
+            for (size_t k = 0; k < paths.active.size(); k++) {// out of bounces, these gather no more light
+                RT_STAT(depth_limit);
+                RT_STAT_PATH_END(max_depth);
+            }
+
+            // connect: add up each pixel's samples
+            float wave_time = profiling ? float(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()) : 0;
+            for (int p = 0; p < pixel_count; p++) {
+                int i = x0 + (first + p) % width, j = y0 + (first + p) / width;
+                colour pixel_color(0,0,0);
+                first_hit pixel_features;
+                int bounces = 0;
+                for (int slot = p * samples; slot < (p + 1) * samples; slot++) {
+                    pixel_color += paths.radiance[slot];
+                    bounces += paths.bounces[slot];
+                    if (recording_aovs) {
+                        pixel_features.albedo += features[slot].albedo;
+                        pixel_features.normal += features[slot].normal;
+                        pixel_features.depth += features[slot].depth;
+                    }
+                }
+                auto index = region_index(i, j);
+                progress.accumulation[index] += pixel_color;
+                progress.sample_counts[index] += samples;
+
+                if (recording_aovs) {
+                    aovs.albedo[index] = pixel_samples_scale * pixel_features.albedo;
+                    aovs.normal[index] = pixel_samples_scale * pixel_features.normal;
+                    aovs.depth[index] = float(pixel_samples_scale * pixel_features.depth);
+                    aovs.object_id[index] = float(features[p * samples].object_id);
+                }
+
+                if (profiling) {// the wave's time is shared evenly between its pixels
+                    pixel_time[index] += wave_time / pixel_count;
+                    pixel_depth[index] += float(bounces);
+                }
+            }
+        }
+    }
+
+    // extend: traces the active paths' rays, misses gather the background and end, hits are
+    // left in paths.shading
+    void extend_paths(path_batch& paths, int depth, const hittable& world, first_hit* features) {
+        paths.sort_by_direction();
+        paths.shading.clear();
+        for (int slot : paths.active) {
+            if (depth == max_depth)
+                ray_counts().primary++;
+            else {
+                ray_counts().secondary++;
+                paths.bounces[slot]++;
+            }
+
+            ray r = paths.path_ray(slot);
+            auto& record = paths.hits[slot];
+            if (!world.hit(r, interval(0.001, INF), record)) {
+                RT_STAT(background_hits);
+                RT_STAT_PATH_END(max_depth - depth);
+                if (features != nullptr && depth == max_depth)
+                    features[slot].albedo = background_colour;
+                paths.radiance[slot] += paths.throughput[slot] * background_colour;
+                continue;
+            }
+
+            // the cone's footprint on the surface, as in ray_colour
+            double cone_width = paths.cone_width[slot] + paths.cone_spread[slot] * record.t * r.direction().length();
+            double cosine = std::fabs(dot(record.normal, r.direction())) / r.direction().length();
+            record.uv_footprint = cone_width * record.uv_scale / std::sqrt(std::max(cosine, 1e-3));
+            paths.cone_width[slot] = cone_width;
+            paths.shading.push_back(slot);
+        }
+    }
+
+    // shade: scatters the paths at their hits, material by material, the paths that go on are
+    // left in paths.active with their next ray
+    void shade_paths(path_batch& paths, int depth, const hittable& world, const hittable& lights, first_hit* features) {
+        paths.sort_by_material();
+        paths.active.clear();
+        size_t run_start = 0, run_end = 0;// hits on the material being shaded, shading[run_start] to shading[run_end - 1]
+        const texture_program* albedo_program = nullptr;
+        for (size_t n = 0; n < paths.shading.size(); n++) {
+            if (n == run_end) {
+                run_start = n;
+                albedo_program = lookup_albedo(paths, run_start, run_end);
+            }
+            int slot = paths.shading[n];
+            ray r = paths.path_ray(slot);
+            const auto& record = paths.hits[slot];
+
+            scatter_record scatter_rec;
+            colour emitted_color = record.mat->emitted(r, record, record.u, record.v, record.p);
+            if (paths.lights_sampled[slot] && already_sampled(r, emitted_color, lights))
+                emitted_color = colour(0,0,0);
+
+            RT_STAT(scatter_calls);
+            bool scattered_ray = albedo_program != nullptr
+                               ? record.mat->scatter_with_albedo(r, record, paths.albedo[n - run_start], scatter_rec)
+                               : record.mat->scatter(r, record, scatter_rec);
+            if (features != nullptr && depth == max_depth) {
+                features[slot].albedo = scattered_ray ? scatter_rec.attenuation : emitted_color;
+                features[slot].normal = record.normal;
+                features[slot].depth = record.t * r.direction().length();
+                features[slot].object_id = record.object_id;
+            }
+
+            if (!scattered_ray) {
+                RT_STAT(absorbed);
+                RT_STAT_PATH_END(max_depth - depth);
+                paths.radiance[slot] += paths.throughput[slot] * emitted_color;
+                continue;
+            }
+
+            if (scatter_rec.skip_pdf) {// specular bounces don't add the emission, as in ray_colour
+                RT_STAT(specular_bounces);
+                paths.throughput[slot] = paths.throughput[slot] * scatter_rec.attenuation;
+                paths.set_ray(slot, scatter_rec.skip_pdf_ray, paths.cone_width[slot], paths.cone_spread[slot]);
+                paths.lights_sampled[slot] = false;
+                paths.active.push_back(slot);
+                continue;
+            }
+
+            RT_STAT(sampled_bounces);
+            bool in_medium = sample_lights && record.mat->is_phase_function();
+            if (in_medium)
+                emitted_color += direct_light(r, record, scatter_rec, world, lights);
+
+            double pdf_value;
+            ray scattered = sample_scatter(r, record, scatter_rec, lights, pdf_value);
+            double scattering_pdf = record.mat->scattering_pdf(r, record, scattered);
+
+            paths.radiance[slot] += paths.throughput[slot] * emitted_color;
+            paths.lights_sampled[slot] = in_medium;
+            paths.throughput[slot] = paths.throughput[slot] * scatter_rec.attenuation * scattering_pdf / pdf_value;
+            paths.set_ray(slot, scattered, paths.cone_width[slot], std::max(paths.cone_spread[slot], scattered_spread));
+            paths.active.push_back(slot);
+        }
+    }
+
+    // Finds the end of the run of hits on the same material that starts at shading[start] and, if the
+    // material scatters by a texture, looks the texture up for the whole run at once into paths.albedo
+    static const texture_program* lookup_albedo(path_batch& paths, size_t start, size_t& end) {
+        const material* mat = paths.hits[paths.shading[start]].mat.get();
+        end = start + 1;
+        while (end < paths.shading.size() && paths.hits[paths.shading[end]].mat.get() == mat)
+            end++;
+
+        auto program = mat->albedo_program();
+        if (program == nullptr)
+            return nullptr;
+        int count = int(end - start);
+        paths.queries.resize(count);
+        paths.albedo.resize(count);
+        for (int i = 0; i < count; i++) {
+            const auto& record = paths.hits[paths.shading[start + i]];
+            paths.queries[i] = texture_query{ record.u, record.v, record.p, record.uv_footprint };
+        }
+        program->value(paths.queries.data(), paths.albedo.data(), count);
+        return program;
+    }
+
+    // Light reaching a scattering point in a medium straight from the lights. A direction is drawn
+    // from the lights, the closest surface along it gives the emission and the media in between
+    // let through their transmittance of it, which grid media estimate by ratio tracking. The ray
+    // scattered from the point then leaves out emission it could have reached this way, see
+    // already_sampled, so the light isn't counted twice.
+    colour direct_light(const ray& r, const hit_record& record, const scatter_record& scatter_rec, const hittable& world,
+                        const hittable& lights) const {
+        hittable_pdf light_pdf(lights, record.p);
+        ray shadow(record.p, light_pdf.generate(), r.time());
+        double pdf_value = light_pdf.value(shadow.direction());
+        hit_record light_record;
+        if (pdf_value <= 0 || !world.hit_surface(shadow, interval(0.001, INF), light_record))
+            return colour(0,0,0);
+
+        colour emitted = light_record.mat->emitted(shadow, light_record, light_record.u, light_record.v, light_record.p);
+        if (emitted.near_zero())
+            return colour(0,0,0);
+        double transmittance = world.transmittance(shadow, interval(0.001, light_record.t));
+        return scatter_rec.attenuation * record.mat->scattering_pdf(r, record, shadow) * transmittance * emitted / pdf_value;
+    }
+
+    // true if r, scattered from a point whose light direct_light sampled, could have been drawn
+    // by the lights, so the emission it hits was counted there
+    static bool already_sampled(const ray& r, const colour& emitted, const hittable& lights) {
+        return !emitted.near_zero() && lights.pdf_value(r.origin(), r.direction()) > 0;
+    }
+
+    // Direction of a sampled (non specular) bounce, drawn from the lights and the material's pdf
+    // when there are lights, and the pdf of drawing it
+    ray sample_scatter(const ray& r, const hit_record& record, const scatter_record& scatter_rec, const hittable& lights,
+                       double& pdf_value) const {
+        if (sample_lights) {
+            auto light_ptr = make_shared<hittable_pdf>(lights, record.p);
+
+            mixture_pdf mixed_pdf(light_ptr, scatter_rec.pdf_ptr);
+
+            ray scattered(record.p, mixed_pdf.generate(), r.time());
+            pdf_value = mixed_pdf.value(scattered.direction());
+            return scattered;
+        }
+        ray scattered(record.p, scatter_rec.pdf_ptr->generate(), r.time());
+        pdf_value = scatter_rec.pdf_ptr->value(scattered.direction());
+        return scattered;
+    }
+
+    void write_profile() const {
+        write_pfm(profile_prefix + "_time.pfm", region_width, region_height, pixel_time);
+        write_pfm(profile_prefix + "_samples.pfm", region_width, region_height, progress.sample_counts);
+
+        std::vector<float> average_bounces(pixel_depth.size());
+        for (size_t i = 0; i < pixel_depth.size(); i++)
+            average_bounces[i] = pixel_depth[i] / progress.sample_counts[i];
+        write_pfm(profile_prefix + "_bounces.pfm", region_width, region_height, average_bounces);
+
+        // log scaled so a few very expensive pixels don't wash out the rest of the map
+        auto range = std::minmax_element(pixel_time.begin(), pixel_time.end());
+        double log_min = std::log1p(*range.first), log_max = std::log1p(*range.second);
+        std::vector<colour> heatmap(pixel_time.size());
+        for (size_t i = 0; i < pixel_time.size(); i++)
+            heatmap[i] = heatmap_colour((std::log1p(pixel_time[i]) - log_min) / std::fmax(log_max - log_min, 1e-6));
+        write_ppm(profile_prefix + "_heatmap.ppm", region_width, region_height, heatmap);
+    }
+
     ray get_ray(int i, int j, int s_i, int s_j) const {
         // Construct a camera ray originating from the focus disk and directed at randomly sampled
         // sampled point around the pixel location i, j for stratified sample square s_i, s_j.
@@ -130,35 +929,92 @@ class camera {
         return cam_center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
     
-    colour ray_colour(const ray& r, int depth, const hittable& world, const hittable& lights) {
-        if(depth<=0)
+    void write_aovs() const {
+        write_pfm(aov_prefix + "_albedo.pfm", region_width, region_height, aovs.albedo);
+        write_pfm(aov_prefix + "_normal.pfm", region_width, region_height, aovs.normal);
+        write_pfm(aov_prefix + "_depth.pfm", region_width, region_height, aovs.depth);
+        write_pfm(aov_prefix + "_id.pfm", region_width, region_height, aovs.object_id);
+    }
+
+    // features is only passed for camera rays, to be filled from the first hit
+    // Texture lookups are filtered over the width of a cone around each ray, which starts as the
+    // pixel's footprint and widens with distance (Akenine-Moller et al. 2019). Mirror and glass
+    // bounces keep the cone's spread, other bounces scatter each sample somewhere different so
+    // their cones are made at least scattered_spread wide.
+    struct ray_cone {
+        double width;  // At the ray's origin
+        double spread; // Radians
+    };
+    static constexpr double scattered_spread = 0.05;
+
+    // lights_sampled is set for rays leaving a point in a medium whose light was sampled directly,
+    // see direct_light
+    colour ray_colour(const ray& r, ray_cone cone, int depth, const hittable& world, const hittable& lights,
+                      first_hit* features = nullptr, bool lights_sampled = false) {
+        if(depth<=0) {
+            RT_STAT(depth_limit);
+            RT_STAT_PATH_END(max_depth);
             return colour(0,0,0);//exceeded max bounce limit so no more light is added
+        }
+
+        if (depth == max_depth)
+            ray_counts().primary++;
+        else
+            ray_counts().secondary++;
 
         hit_record record;
 
         // If the ray doesn't hit anything return the background colour
-        if(!world.hit(r, interval(0.001, INF), record))
+        if(!world.hit(r, interval(0.001, INF), record)) {
+            RT_STAT(background_hits);
+            RT_STAT_PATH_END(max_depth - depth);
+            if (features != nullptr)
+                features->albedo = background_colour;
             return background_colour;
+        }
+
+        // the cone's footprint on the surface, the geometric mean of its widths across and along a slanted surface
+        double cone_width = cone.width + cone.spread * record.t * r.direction().length();
+        double cosine = std::fabs(dot(record.normal, r.direction())) / r.direction().length();
+        record.uv_footprint = cone_width * record.uv_scale / std::sqrt(std::max(cosine, 1e-3));
 
         scatter_record scatter_rec;
         colour emitted_color = record.mat->emitted(r, record, record.u, record.v, record.p);
+        if (lights_sampled && already_sampled(r, emitted_color, lights))
+            emitted_color = colour(0,0,0);
         
-        if (!record.mat->scatter(r, record, scatter_rec))//if the ray doesn't get absorbed
+        RT_STAT(scatter_calls);
+        bool scattered_ray = record.mat->scatter(r, record, scatter_rec);
+        if (features != nullptr) {
+            features->albedo = scattered_ray ? scatter_rec.attenuation : emitted_color;
+            features->normal = record.normal;
+            features->depth = record.t * r.direction().length();
+            features->object_id = record.object_id;
+        }
+
+        if (!scattered_ray) {//if the ray doesn't get absorbed
+            RT_STAT(absorbed);
+            RT_STAT_PATH_END(max_depth - depth);
             return emitted_color;//ray was absorbed only return the emission colour
+        }
+
+        if (scatter_rec.skip_pdf) {
+            RT_STAT(specular_bounces);
+            return scatter_rec.attenuation * ray_colour(scatter_rec.skip_pdf_ray, ray_cone{ cone_width, cone.spread }, depth - 1, world, lights);//implicitly sampled ray to skip pdf for specular
+        }
 
-        if (scatter_rec.skip_pdf)
-            return scatter_rec.attenuation * ray_colour(scatter_rec.skip_pdf_ray, depth - 1, world, lights);//implicitly sampled ray to skip pdf for specular
+        RT_STAT(sampled_bounces);
 
-        auto light_ptr = make_shared<hittable_pdf>(lights, record.p);
-        
-        mixture_pdf mixed_pdf(light_ptr, scatter_rec.pdf_ptr);
+        bool in_medium = sample_lights && record.mat->is_phase_function();
+        if (in_medium)
+            emitted_color += direct_light(r, record, scatter_rec, world, lights);
 
-        ray scattered = ray(record.p, mixed_pdf.generate(), r.time());
-        auto pdf_value = mixed_pdf.value(scattered.direction());
-        
+        double pdf_value;
+        ray scattered = sample_scatter(r, record, scatter_rec, lights, pdf_value);
         double scattering_pdf = record.mat->scattering_pdf(r, record, scattered);
 
-        colour sample_colour = ray_colour(scattered, depth-1, world, lights);
+        colour sample_colour = ray_colour(scattered, ray_cone{ cone_width, std::max(cone.spread, scattered_spread) }, depth-1, world, lights,
+                                          nullptr, in_medium);
         colour colour_from_scatter = (scatter_rec.attenuation * scattering_pdf * sample_colour) / pdf_value; //pdf integration formula
 
         return emitted_color + colour_from_scatter;
@@ -0,0 +1,146 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "headers.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Accumulated samples of a progressive render. Every pass adds the same number of samples to
+// each pixel and seeds its tiles from the base seed, tile and pass index, so the random number
+// state never has to be saved. A render resumed from a checkpoint takes exactly the samples the
+// uninterrupted render would have.
+
+const uint32_t checkpoint_version = 3;
+
+struct render_checkpoint {
+    int x0 = 0, y0 = 0;// top left of the crop window in the frame
+    int width = 0;
+    int height = 0;
+    unsigned int seed = 0;
+    int pass_samples = 0;// samples added to each pixel by a pass
+    int passes = 0;// passes accumulated so far
+    uint64_t settings = 0;// hash of the scene and the camera and integrator settings the samples were traced with
+    std::vector<colour> accumulation;// sum of the samples of each pixel
+    std::vector<float> sample_counts;// samples in each pixel's sum
+
+    void reset(int window_x0, int window_y0, int image_width, int image_height, unsigned int base_seed, int samples_per_pass,
+               uint64_t settings_hash = 0) {
+        x0 = window_x0;
+        y0 = window_y0;
+        width = image_width;
+        height = image_height;
+        seed = base_seed;
+        pass_samples = samples_per_pass;
+        settings = settings_hash;
+        passes = 0;
+        accumulation.assign(size_t(width) * height, colour(0,0,0));
+        sample_counts.assign(size_t(width) * height, 0.0f);
+    }
+
+    // whether this state can be continued by a render with these settings
+    bool matches(int window_x0, int window_y0, int image_width, int image_height, unsigned int base_seed, int samples_per_pass,
+                 uint64_t settings_hash) const {
+        return x0 == window_x0 && y0 == window_y0 && width == image_width && height == image_height && seed == base_seed
+            && pass_samples == samples_per_pass && settings == settings_hash;
+    }
+
+    // adds the samples of another pass of the same render, the result only matches a single
+    // process render when passes are added in order
+    void add_pass(const render_checkpoint& pass) {
+        for (size_t i = 0; i < accumulation.size(); i++) {
+            accumulation[i] += pass.accumulation[i];
+            sample_counts[i] += pass.sample_counts[i];
+        }
+        passes++;
+    }
+
+    colour average(size_t pixel) const {
+        return (1.0 / sample_counts[pixel]) * accumulation[pixel];
+    }
+
+    // written to a temporary file first and renamed over the old checkpoint, so a render killed
+    // while saving still leaves the previous checkpoint intact
+    bool save(const std::string& filename) const {
+        std::string temporary = filename + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            if (!out) {
+                std::cerr << "ERROR: Could not open checkpoint file '" << temporary << "'.\n";
+                return false;
+            }
+            int32_t header[8] = { width, height, int32_t(seed), pass_samples, passes, x0, y0, 0 };
+            out.write("RTCK", 4);
+            out.write(reinterpret_cast<const char*>(&checkpoint_version), sizeof(checkpoint_version));
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(&settings), sizeof(settings));
+            out.write(reinterpret_cast<const char*>(accumulation.data()), accumulation.size() * sizeof(colour));
+            out.write(reinterpret_cast<const char*>(sample_counts.data()), sample_counts.size() * sizeof(float));
+            if (!out) {
+                std::cerr << "ERROR: Could not write checkpoint file '" << temporary << "'.\n";
+                return false;
+            }
+        }
+#ifdef _WIN32
+        std::remove(filename.c_str());// rename doesn't replace an existing file on windows, elsewhere it does so atomically
+#endif
+        if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            std::cerr << "ERROR: Could not rename '" << temporary << "' to '" << filename << "'.\n";
+            return false;
+        }
+        return true;
+    }
+
+    // returns false if the file is missing or isn't a checkpoint this build can read
+    bool load(const std::string& filename) {
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        if (!in)
+            return false;
+        auto file_size = uint64_t(in.tellg());
+        in.seekg(0);
+
+        char magic[4];
+        uint32_t version;
+        int32_t header[8];
+        uint64_t settings_hash;
+        in.read(magic, 4);
+        in.read(reinterpret_cast<char*>(&version), sizeof(version));
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        in.read(reinterpret_cast<char*>(&settings_hash), sizeof(settings_hash));
+        if (!in || std::memcmp(magic, "RTCK", 4) != 0 || version != checkpoint_version || header[0] <= 0 || header[1] <= 0) {
+            std::cerr << "ERROR: '" << filename << "' is not a render checkpoint.\n";
+            return false;
+        }
+
+        // the pixels have to be in the file before the buffers are sized for them
+        uint64_t pixel_bytes = uint64_t(header[0]) * uint64_t(header[1]) * (sizeof(colour) + sizeof(float));
+        if (file_size - uint64_t(in.tellg()) != pixel_bytes) {
+            std::cerr << "ERROR: Checkpoint '" << filename << "' is truncated.\n";
+            return false;
+        }
+
+        width = header[0];
+        height = header[1];
+        seed = unsigned(header[2]);
+        pass_samples = header[3];
+        passes = header[4];
+        x0 = header[5];
+        y0 = header[6];
+        settings = settings_hash;
+        accumulation.resize(size_t(width) * height);
+        sample_counts.resize(size_t(width) * height);
+        in.read(reinterpret_cast<char*>(accumulation.data()), accumulation.size() * sizeof(colour));
+        in.read(reinterpret_cast<char*>(sample_counts.data()), sample_counts.size() * sizeof(float));
+        if (!in) {
+            std::cerr << "ERROR: Checkpoint '" << filename << "' is truncated.\n";
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
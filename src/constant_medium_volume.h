@@ -4,6 +4,7 @@
 #include "hittable.h"
 #include "material.h"
 #include "texture.h"
+#include "stats.h"
 class constant_medium : public hittable {
   public:
     constant_medium(shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex)
@@ -16,48 +17,60 @@ class constant_medium : public hittable {
     {}
 
     bool hit(const ray& r, interval ray_t, hit_record& record) const override {
-        hit_record rec1, rec2;
+        RT_STAT(medium_tests);
 
-        // Check if the ray hits the bounding box
-        if (!boundary->hit(r, interval::universe, rec1))
+        // The parts of the ray inside the boundary, found in one query
+        thread_local std::vector<interval> spans;
+        boundary->hit_span(r, interval(std::fmax(ray_t.min, 0), ray_t.max), spans);
+        if (spans.empty())
             return false;
 
-        // Check if the point hits the other side of the box (by adding small amount to the original hit t)
-        if (!boundary->hit(r, interval(rec1.t+0.0001, INF), rec2))
-            return false;
-
-        // Clamp the hit t to the ray interval min & max
-        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
-
-        // The ray must hit the first side first, not sure how this would be possible
-        if (rec1.t >= rec2.t)
-            return false;
-        
-        if (rec1.t < 0)
-            rec1.t = 0;
-
         // Record the hit based of probability inside the volume, proportional to the density of the volume
         auto ray_length = r.direction().length();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
         auto hit_distance = negative_inverse_density * std::log(random_double());//Use the density and a random value to get the hit distance
 
-        if (hit_distance > distance_inside_boundary)
-            return false;
+        // the distance is used up across the spans in order, so rays can leave and re-enter a concave boundary
+        for (const auto& span : spans) {
+            auto distance_inside_span = (span.max - span.min) * ray_length;
+            if (hit_distance > distance_inside_span) {
+                hit_distance -= distance_inside_span;
+                continue;
+            }
 
-        record.t = rec1.t + hit_distance / ray_length;//scale to the length of the ray then add it to the first intersection
+            record.t = span.min + hit_distance / ray_length;//scale to the length of the ray then add it to the entry point
 
-        record.p = r.at(record.t);//get the point along the ray the hit occurred
+            record.p = r.at(record.t);//get the point along the ray the hit occurred
 
-        record.normal = vec3(1,0,0);  // arbitrary
-        record.front_face = true;     // also arbitrary
-        record.mat = phase_function;
-        // assumes the volume boundary is convex (the ray will exit without rentering the boundary)
-        return true;
+            record.normal = vec3(1,0,0);  // arbitrary
+            record.front_face = true;     // also arbitrary
+            record.uv_scale = 0;
+            record.mat = phase_function;
+            record.object_id = object_id;
+            return true;
+        }
+        return false;
+    }
+
+    bool hit_surface(const ray& r, interval ray_t, hit_record& record) const override { return false; }
+
+    // the density is the same everywhere, so the light that gets through falls off exponentially
+    // with the distance the ray travels inside
+    double transmittance(const ray& r, interval ray_t) const override {
+        thread_local std::vector<interval> spans;
+        boundary->hit_span(r, interval(std::fmax(ray_t.min, 0), ray_t.max), spans);
+        double distance_inside = 0;
+        for (const auto& span : spans)
+            distance_inside += (span.max - span.min) * r.direction().length();
+        return std::exp(distance_inside / negative_inverse_density);
     }
 
     aabb bounding_box() const override { return boundary->bounding_box(); }
 
+    void measure(memory_usage& usage) const override {
+        usage.geometry += sizeof(constant_medium);
+        measure_object(boundary, usage);
+    }
+
   private:
     shared_ptr<hittable> boundary;
     double negative_inverse_density;
@@ -0,0 +1,152 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "headers.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+// Edge avoiding a-trous wavelet filter for low sample renders (Dammertz et al. 2010). Each pass
+// blurs with a 5x5 B3 spline kernel whose taps are spread 2^pass pixels apart, and every tap is
+// weighted down by how much its colour, normal and depth differ from the centre pixel so the blur
+// stops at geometric edges. The colour is divided by the albedo first so texture detail isn't
+// blurred, then multiplied back at the end.
+//
+// The image is held as separate float planes and each pass runs tap by tap over whole rows, so
+// the inner loops are over contiguous floats the compiler can vectorise. Rows are split across
+// threads.
+
+class denoiser {
+  public:
+    int   iterations = 5;
+    float sigma_colour = 4.0f;   // Relative luminance difference tolerated in the first pass, halves every pass
+    float sigma_normal = 0.1f;   // Normal difference (1 - cos) tolerated
+    float sigma_depth = 0.05f;   // Depth difference tolerated, relative to the pixel's depth
+    int   thread_count = 1;
+
+    std::vector<colour> denoise(const std::vector<colour>& image, const std::vector<colour>& albedo,
+                                const std::vector<colour>& normal, const std::vector<float>& depth,
+                                int width, int height) const {
+        size_t pixel_count = size_t(width) * height;
+        planes in(pixel_count), out(pixel_count);
+        std::vector<float> albedo_planes[3], normal_planes[3];
+        for (int c = 0; c < 3; c++) {
+            albedo_planes[c].resize(pixel_count);
+            normal_planes[c].resize(pixel_count);
+        }
+
+        // demodulate, surfaces with almost no albedo are filtered as they are
+        for (size_t i = 0; i < pixel_count; i++) {
+            for (int c = 0; c < 3; c++) {
+                float a = float(albedo[i][c]);
+                albedo_planes[c][i] = a > 1e-3f ? a : 1.0f;
+                normal_planes[c][i] = float(normal[i][c]);
+                float value = float(image[i][c]);
+                in.rgb[c][i] = (value == value ? value : 0.0f) / albedo_planes[c][i];// NaNs become black
+            }
+        }
+
+        for (int pass = 0; pass < iterations; pass++) {
+            float colour_sigma = sigma_colour / float(1 << pass);
+            int step = 1 << pass;
+            // the taps read the luminance of other threads' rows, so it's all written before filtering starts
+            parallel_rows(height, [&](int y0, int y1) {
+                luminance_rows(in, width, y0, y1);
+            });
+            parallel_rows(height, [&](int y0, int y1) {
+                filter_rows(in, out, normal_planes, depth, width, height, y0, y1, step, colour_sigma);
+            });
+            std::swap(in, out);
+        }
+
+        std::vector<colour> result(pixel_count);
+        for (size_t i = 0; i < pixel_count; i++)
+            result[i] = colour(in.rgb[0][i] * albedo_planes[0][i], in.rgb[1][i] * albedo_planes[1][i], in.rgb[2][i] * albedo_planes[2][i]);
+        return result;
+    }
+
+  private:
+    struct planes {
+        std::vector<float> rgb[3];
+        std::vector<float> luminance;
+
+        planes(size_t size) {
+            for (auto& plane : rgb)
+                plane.resize(size);
+            luminance.resize(size);
+        }
+    };
+
+    template <typename Rows>
+    void parallel_rows(int height, Rows rows) const {
+        int threads_to_use = std::max(1, std::min(thread_count, height));
+        std::vector<std::thread> threads;
+        for (int t = 1; t < threads_to_use; t++)
+            threads.emplace_back(rows, height * t / threads_to_use, height * (t + 1) / threads_to_use);
+        rows(0, height / threads_to_use);
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    static void luminance_rows(planes& in, int width, int y0, int y1) {
+        for (size_t i = size_t(y0) * width; i < size_t(y1) * width; i++)
+            in.luminance[i] = 0.2126f*in.rgb[0][i] + 0.7152f*in.rgb[1][i] + 0.0722f*in.rgb[2][i];
+    }
+
+    void filter_rows(const planes& in, planes& out, const std::vector<float> (&normal)[3], const std::vector<float>& depth,
+                     int width, int height, int y0, int y1, int step, float colour_sigma) const {
+        static const float kernel[5] = { 1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16 };
+
+        std::vector<float> sum_r(width), sum_g(width), sum_b(width), sum_w(width);
+        std::vector<int> column(width);
+
+        for (int y = y0; y < y1; y++) {
+            std::fill(sum_r.begin(), sum_r.end(), 0.0f);
+            std::fill(sum_g.begin(), sum_g.end(), 0.0f);
+            std::fill(sum_b.begin(), sum_b.end(), 0.0f);
+            std::fill(sum_w.begin(), sum_w.end(), 0.0f);
+            const size_t centre_row = size_t(y) * width;
+
+            for (int ky = 0; ky < 5; ky++) {
+                int ty = std::min(std::max(y + (ky - 2)*step, 0), height - 1);
+                const size_t tap_row = size_t(ty) * width;
+
+                for (int kx = 0; kx < 5; kx++) {
+                    const float k = kernel[ky] * kernel[kx];
+                    for (int x = 0; x < width; x++)// clamped at the image edges
+                        column[x] = std::min(std::max(x + (kx - 2)*step, 0), width - 1);
+
+                    for (int x = 0; x < width; x++) {
+                        const size_t p = centre_row + x;
+                        const size_t q = tap_row + column[x];
+
+                        float lum_p = in.luminance[p], lum_q = in.luminance[q];
+                        float colour_weight = std::exp(-std::fabs(lum_p - lum_q) / (colour_sigma * 0.5f * (lum_p + lum_q) + 1e-4f));
+
+                        float cos_normal = normal[0][p]*normal[0][q] + normal[1][p]*normal[1][q] + normal[2][p]*normal[2][q];
+                        float normal_weight = std::exp(-std::max(0.0f, 1.0f - cos_normal) / sigma_normal);
+
+                        float depth_scale = sigma_depth * std::max(depth[p], depth[q]) + 1e-6f;
+                        float depth_weight = std::exp(-std::fabs(depth[p] - depth[q]) / depth_scale);
+
+                        float w = k * colour_weight * normal_weight * depth_weight;
+                        sum_r[x] += w * in.rgb[0][q];
+                        sum_g[x] += w * in.rgb[1][q];
+                        sum_b[x] += w * in.rgb[2][q];
+                        sum_w[x] += w;
+                    }
+                }
+            }
+
+            for (int x = 0; x < width; x++) {// the centre tap always has weight so sum_w > 0
+                out.rgb[0][centre_row + x] = sum_r[x] / sum_w[x];
+                out.rgb[1][centre_row + x] = sum_g[x] / sum_w[x];
+                out.rgb[2][centre_row + x] = sum_b[x] / sum_w[x];
+            }
+        }
+    }
+};
+
+#endif
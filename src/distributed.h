@@ -0,0 +1,377 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "headers.h"
+
+#include "camera.h"
+#include "checkpoint.h"
+#include "scene_loader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+    #include <csignal>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+// Renders the passes of a progressive render in worker processes. The coordinator listens on a
+// unix socket and hands out pass indices, each worker loads the scene, traces the whole pass and
+// sends back its accumulation buffer. Passes are seeded the same wherever they are traced and the
+// coordinator adds them to the image in pass order, so the result matches a single process render
+// with the same passes. Workers can join at any time by connecting to the socket, and the pass of
+// a worker that goes away is handed to another one.
+
+struct render_job {
+    std::string scene_file;// absolute, so workers started from another directory find it
+    int image_width = 0;
+    double aspect_ratio = 1;
+    int samples_per_pixel = 1;
+    int pass_samples = 1;
+    unsigned int seed = 0;
+    int crop[4] = { 0, 0, 0, 0 };// camera crop window, x0, y0, x1, y1
+    bool wavefront = false;
+};
+
+#ifndef _WIN32
+
+namespace distributed {
+    const int32_t finished = -1;// sent instead of a pass index when there is no more work
+
+    struct job_message {
+        char magic[4];// "RTJB"
+        int32_t image_width;
+        int32_t samples_per_pixel;
+        int32_t pass_samples;
+        uint32_t seed;
+        int32_t scene_file_length;// the path follows the message
+        int32_t crop[4];
+        int32_t wavefront;
+        double aspect_ratio;
+    };
+
+    struct pass_message {
+        int32_t pass;
+        int32_t width;
+        int32_t height;
+        int32_t padding;// the accumulation then the sample counts follow the message
+    };
+
+    inline bool send_all(int fd, const void* data, size_t size) {
+        auto bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            auto sent = ::write(fd, bytes, size);
+            if (sent <= 0)
+                return false;
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    inline bool receive_all(int fd, void* data, size_t size) {
+        auto bytes = static_cast<char*>(data);
+        while (size > 0) {
+            auto received = ::read(fd, bytes, size);
+            if (received <= 0)
+                return false;
+            bytes += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    inline bool make_address(const std::string& socket_path, sockaddr_un& address) {
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "ERROR: Socket path '" << socket_path << "' is too long.\n";
+            return false;
+        }
+        std::strcpy(address.sun_path, socket_path.c_str());
+        return true;
+    }
+}
+
+// Connects to a coordinator and renders the passes it hands out until it says there are none left
+inline bool run_render_worker(const std::string& socket_path, int thread_count) {
+    sockaddr_un address;
+    if (!distributed::make_address(socket_path, address))
+        return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "ERROR: Could not connect to coordinator at '" << socket_path << "'.\n";
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    std::signal(SIGPIPE, SIG_IGN);// a coordinator that goes away shows up as a failed write instead
+
+    distributed::job_message job;
+    std::string scene_file;
+    bool ok = distributed::receive_all(fd, &job, sizeof(job)) && std::memcmp(job.magic, "RTJB", 4) == 0
+           && job.scene_file_length > 0;
+    if (ok) {
+        scene_file.resize(job.scene_file_length);
+        ok = distributed::receive_all(fd, &scene_file[0], scene_file.size());
+    }
+    if (!ok) {
+        std::cerr << "ERROR: Bad job from coordinator at '" << socket_path << "'.\n";
+        close(fd);
+        return false;
+    }
+
+    scene loaded;
+    scene_loader loader;
+    if (!loader.load(scene_file, loaded)) {
+        close(fd);
+        return false;
+    }
+    auto& cam = loaded.cam;
+    cam.image_width = job.image_width;
+    cam.aspect_ratio = job.aspect_ratio;
+    cam.samples_per_pixel = job.samples_per_pixel;
+    cam.pass_samples = job.pass_samples;
+    cam.seed = job.seed;
+    cam.crop_x0 = job.crop[0];
+    cam.crop_y0 = job.crop[1];
+    cam.crop_x1 = job.crop[2];
+    cam.crop_y1 = job.crop[3];
+    cam.wavefront = job.wavefront != 0;
+    cam.thread_count = thread_count > 0 ? thread_count : 1;
+    cam.show_progress = false;
+
+    int32_t pass;
+    while (distributed::receive_all(fd, &pass, sizeof(pass)) && pass != distributed::finished) {
+        const auto& result = cam.render_pass(loaded.world, loaded.lights, pass);
+        distributed::pass_message message = { pass, result.width, result.height, 0 };
+        if (!distributed::send_all(fd, &message, sizeof(message))
+            || !distributed::send_all(fd, result.accumulation.data(), result.accumulation.size() * sizeof(colour))
+            || !distributed::send_all(fd, result.sample_counts.data(), result.sample_counts.size() * sizeof(float)))
+            break;
+    }
+    close(fd);
+    return true;
+}
+
+class render_coordinator {
+  public:
+    bool show_progress = true;// Print the passes remaining and connected workers to the console
+
+    // Renders the job with local_workers forked worker processes plus any that join through the
+    // socket, and writes the image to out as a .ppm
+    bool render(const render_job& job, const std::string& socket_path, int local_workers, int worker_threads, std::ostream& out) {
+        camera planner;// only used to split the samples into passes the same way a single process render does
+        planner.samples_per_pixel = job.samples_per_pixel;
+        planner.pass_samples = job.pass_samples;
+        pass_count = planner.pass_count();
+        for (int pass = 0; pass < pass_count; pass++)
+            pending.push_back(pass);
+
+        if (!listen_on(socket_path))
+            return false;
+        std::signal(SIGPIPE, SIG_IGN);// writes to a worker that died fail instead of killing the coordinator
+
+        for (int i = 0; i < local_workers; i++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(listen_fd);
+                _exit(run_render_worker(socket_path, worker_threads) ? 0 : 1);
+            }
+            if (pid > 0)
+                children.push_back(pid);
+        }
+        if (show_progress)
+            std::clog << "Rendering " << pass_count << " passes, workers can join with --join " << socket_path << "\n";
+
+        bool ok = serve(job);
+
+        for (auto& worker : workers) {
+            distributed::send_all(worker.fd, &distributed::finished, sizeof(distributed::finished));
+            close(worker.fd);
+        }
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        for (auto pid : children)
+            if (pid > 0)
+                waitpid(pid, nullptr, 0);
+        if (!ok)
+            return false;
+
+        out << "P3\n" << image.width << ' ' << image.height << "\n255\n";
+        for (size_t i = 0; i < image.accumulation.size(); i++)
+            write_color(out, image.average(i));
+        if (show_progress)
+            std::clog << "\rDone.                                  \n";
+        return true;
+    }
+
+  private:
+    struct worker {
+        int fd;
+        int pass;// being rendered, or -1 if idle
+    };
+
+    int listen_fd = -1;
+    int pass_count = 0;
+    std::deque<int> pending;// passes not handed out yet
+    std::map<int, render_checkpoint> finished_passes;// received but waiting for earlier passes
+    render_checkpoint image;// passes added so far
+    std::vector<worker> workers;
+    std::vector<pid_t> children;
+
+    bool listen_on(const std::string& socket_path) {
+        sockaddr_un address;
+        if (!distributed::make_address(socket_path, address))
+            return false;
+        unlink(socket_path.c_str());// left behind by a coordinator that was killed
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || listen(listen_fd, 16) != 0) {
+            std::cerr << "ERROR: Could not listen on '" << socket_path << "'.\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool serve(const render_job& job) {
+        while (image.passes < pass_count) {
+            std::vector<pollfd> fds(1, pollfd{ listen_fd, POLLIN, 0 });
+            for (const auto& w : workers)
+                fds.push_back(pollfd{ w.fd, POLLIN, 0 });
+            if (poll(fds.data(), fds.size(), 1000) < 0)
+                continue;// interrupted by a signal
+
+            // back to front so removing a worker doesn't shift the ones still to check
+            for (size_t i = fds.size() - 1; i > 0; i--) {
+                if (fds[i].revents != 0 && !receive_pass(workers[i - 1]))
+                    drop_worker(i - 1);
+            }
+            if (fds[0].revents & POLLIN)
+                accept_worker(job);
+            hand_out_passes();
+
+            if (workers.empty() && !children.empty() && all_children_exited()) {
+                std::cerr << "ERROR: Every worker stopped before the render finished.\n";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void accept_worker(const render_job& job) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            return;
+        distributed::job_message message;
+        std::memcpy(message.magic, "RTJB", 4);
+        message.image_width = job.image_width;
+        message.samples_per_pixel = job.samples_per_pixel;
+        message.pass_samples = job.pass_samples;
+        message.seed = job.seed;
+        message.scene_file_length = int32_t(job.scene_file.size());
+        std::copy_n(job.crop, 4, message.crop);
+        message.wavefront = job.wavefront ? 1 : 0;
+        message.aspect_ratio = job.aspect_ratio;
+        if (!distributed::send_all(fd, &message, sizeof(message))
+            || !distributed::send_all(fd, job.scene_file.data(), job.scene_file.size())) {
+            close(fd);
+            return;
+        }
+        workers.push_back(worker{ fd, -1 });
+        print_progress();
+    }
+
+    void hand_out_passes() {
+        for (size_t i = workers.size(); i-- > 0;) {
+            if (workers[i].pass >= 0 || pending.empty())
+                continue;
+            workers[i].pass = pending.front();
+            pending.pop_front();
+            if (!distributed::send_all(workers[i].fd, &workers[i].pass, sizeof(int32_t)))
+                drop_worker(i);
+        }
+    }
+
+    // returns false if the worker disconnected or sent something that isn't the pass it was given
+    bool receive_pass(worker& w) {
+        distributed::pass_message message;
+        if (w.pass < 0 || !distributed::receive_all(w.fd, &message, sizeof(message)) || message.pass != w.pass
+            || message.width <= 0 || message.height <= 0)
+            return false;
+        if (image.passes == 0 && image.accumulation.empty())
+            image.reset(0, 0, message.width, message.height, 0, 0);
+        if (message.width != image.width || message.height != image.height)
+            return false;
+
+        render_checkpoint result;
+        result.reset(0, 0, message.width, message.height, 0, 0);
+        if (!distributed::receive_all(w.fd, result.accumulation.data(), result.accumulation.size() * sizeof(colour))
+            || !distributed::receive_all(w.fd, result.sample_counts.data(), result.sample_counts.size() * sizeof(float)))
+            return false;
+
+        finished_passes[w.pass] = std::move(result);
+        w.pass = -1;
+        while (!finished_passes.empty() && finished_passes.begin()->first == image.passes) {// add in pass order
+            image.add_pass(finished_passes.begin()->second);
+            finished_passes.erase(finished_passes.begin());
+        }
+        print_progress();
+        return true;
+    }
+
+    void drop_worker(size_t index) {
+        if (workers[index].pass >= 0)
+            pending.push_front(workers[index].pass);// someone else renders it
+        close(workers[index].fd);
+        workers.erase(workers.begin() + index);
+        print_progress();
+    }
+
+    bool all_children_exited() {
+        for (auto& pid : children) {
+            if (pid > 0 && waitpid(pid, nullptr, WNOHANG) == pid)
+                pid = -1;
+        }
+        for (auto pid : children)
+            if (pid > 0)
+                return false;
+        children.clear();
+        return true;
+    }
+
+    void print_progress() const {
+        if (show_progress)
+            std::clog << "\rPasses remaining: " << pass_count - image.passes << ", workers: " << workers.size() << "   " << std::flush;
+    }
+};
+
+#else
+
+inline bool run_render_worker(const std::string&, int) {
+    std::cerr << "ERROR: Distributed rendering needs unix sockets.\n";
+    return false;
+}
+
+class render_coordinator {
+  public:
+    bool show_progress = true;
+
+    bool render(const render_job&, const std::string&, int, int, std::ostream&) {
+        std::cerr << "ERROR: Distributed rendering needs unix sockets.\n";
+        return false;
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef FLAT_SCENE_H
+#define FLAT_SCENE_H
+
+#include "headers.h"
+
+#include <cstdint>
+#include <vector>
+
+class material;
+
+// Plain data records for a scene flattened into arrays, these are written to disk by the scene
+// cache as is so they must stay trivially copyable and fixed size
+
+enum flat_primitive_type : int32_t {
+    FLAT_SPHERE = 0,
+    FLAT_QUAD = 1,
+    FLAT_TRIANGLE = 2,
+    FLAT_ELLIPSE = 3,
+    FLAT_ANNULUS = 4,
+};
+
+enum flat_material_type : int32_t {
+    FLAT_LAMBERTIAN = 0,
+    FLAT_METAL = 1,
+    FLAT_DIELECTRIC = 2,
+    FLAT_DIFFUSE_LIGHT = 3,
+};
+
+struct flat_material {
+    int32_t type;
+    int32_t padding;
+    double params[4];// rgb colour then fuzz or refraction index
+};
+
+struct flat_primitive {
+    int32_t type;
+    int32_t material;// index into the material records
+    // sphere: center, displacement, radius
+    // quad: Q, u, v, normal, w, D, annulus inner radius
+    double data[17];
+};
+
+struct flat_node {
+    double bounds[6];// x, y, z min/max pairs
+    int32_t first;// leaf: first primitive, internal: index of the second child (the first follows this node)
+    int32_t count;// number of primitives in a leaf, 0 for internal nodes
+};
+
+// Collects the primitives of a hittable tree in world space, transforms are baked into the
+// primitives as the tree is walked
+class scene_writer {
+  public:
+    std::vector<flat_primitive> primitives;
+    std::vector<const material*> primitive_materials;// material of each primitive, resolved when the cache is built
+
+    // compose a translation inside the current transform
+    void push_translate(const vec3& offset) {
+        stack.push_back(current);
+        current.offset = apply(offset);
+    }
+
+    // compose a rotation about y inside the current transform
+    void push_rotate_y(double sin_theta, double cos_theta) {
+        stack.push_back(current);
+        // object to world rotation, matches rotate_y::hit transforming the hit back to world space
+        vec3 col_x = rotate(vec3(cos_theta, 0, -sin_theta));
+        vec3 col_y = rotate(vec3(0, 1, 0));
+        vec3 col_z = rotate(vec3(sin_theta, 0, cos_theta));
+        current.cols[0] = col_x;
+        current.cols[1] = col_y;
+        current.cols[2] = col_z;
+    }
+
+    void pop_transform() {
+        current = stack.back();
+        stack.pop_back();
+    }
+
+    void add_sphere(const point3& center, const vec3& displacement, double radius, const material* mat) {
+        flat_primitive prim = {};
+        prim.type = FLAT_SPHERE;
+        store(prim.data, apply(center));
+        store(prim.data + 3, rotate(displacement));
+        prim.data[6] = radius;
+        add(prim, mat);
+    }
+
+    void add_quad(int32_t type, const point3& Q, const vec3& u, const vec3& v, double inner, const material* mat) {
+        flat_primitive prim = {};
+        prim.type = type;
+        auto world_Q = apply(Q);
+        auto world_u = rotate(u);
+        auto world_v = rotate(v);
+        auto n = cross(world_u, world_v);
+        auto normal = unit_vector(n);
+        store(prim.data, world_Q);
+        store(prim.data + 3, world_u);
+        store(prim.data + 6, world_v);
+        store(prim.data + 9, normal);
+        store(prim.data + 12, n / dot(n, n));
+        prim.data[15] = dot(normal, world_Q);
+        prim.data[16] = inner;
+        add(prim, mat);
+    }
+
+  private:
+    struct transform {
+        vec3 cols[3] = { vec3(1,0,0), vec3(0,1,0), vec3(0,0,1) };
+        vec3 offset = vec3(0,0,0);
+    };
+    transform current;
+    std::vector<transform> stack;
+
+    vec3 rotate(const vec3& v) const {
+        return v[0]*current.cols[0] + v[1]*current.cols[1] + v[2]*current.cols[2];
+    }
+
+    point3 apply(const point3& p) const {
+        return rotate(p) + current.offset;
+    }
+
+    static void store(double* out, const vec3& v) {
+        out[0] = v.x();
+        out[1] = v.y();
+        out[2] = v.z();
+    }
+
+    void add(const flat_primitive& prim, const material* mat) {
+        primitives.push_back(prim);
+        primitive_materials.push_back(mat);
+    }
+};
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef GRID_VOLUME_H
+#define GRID_VOLUME_H
+
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Participating media whose density varies through space, such as smoke and clouds.
+//
+// The density is held in a sparse grid of voxels stored in bricks of brick_size^3, bricks with
+// nothing in them aren't stored at all. Every brick has a majorant, the most density any point in
+// it can have, and every cell of coarse_bricks^3 bricks has the largest majorant of its bricks.
+// A ray walks the coarse cells and then the bricks inside them, skipping the empty ones, and in
+// each brick free flight distances are sampled by delta tracking against the brick's majorant.
+
+class density_grid {
+  public:
+    static const int brick_size = 8;     // Voxels along each side of a brick
+    static const int coarse_bricks = 4;  // Bricks along each side of a cell of the coarse majorant grid
+
+    // An empty grid of nx by ny by nz voxels filling bounds
+    density_grid(const aabb& bounds, int nx, int ny, int nz) : bounds(bounds) {
+        voxel_count[0] = std::max(1, nx);
+        voxel_count[1] = std::max(1, ny);
+        voxel_count[2] = std::max(1, nz);
+        for (int a = 0; a < 3; a++) {
+            voxel_size[a] = bounds.axis_interval(a).size() / voxel_count[a];
+            brick_count[a] = (voxel_count[a] + brick_size - 1) / brick_size;
+            coarse_count[a] = (brick_count[a] + coarse_bricks - 1) / coarse_bricks;
+        }
+        brick_offset.assign(size_t(brick_count[0]) * brick_count[1] * brick_count[2], -1);
+        brick_majorant.assign(brick_offset.size(), 0.0f);
+        coarse_majorant.assign(size_t(coarse_count[0]) * coarse_count[1] * coarse_count[2], 0.0f);
+    }
+
+    // Sets each voxel to density(centre of the voxel), negative values are taken as zero
+    template <typename Density>
+    void fill(Density density) {
+        const int voxels_per_brick = brick_size * brick_size * brick_size;
+        std::vector<float> brick(voxels_per_brick);
+        voxels.clear();
+        for (int bz = 0; bz < brick_count[2]; bz++)
+        for (int by = 0; by < brick_count[1]; by++)
+        for (int bx = 0; bx < brick_count[0]; bx++) {
+            bool occupied = false;
+            for (int z = 0; z < brick_size; z++)
+            for (int y = 0; y < brick_size; y++)
+            for (int x = 0; x < brick_size; x++) {
+                int i = bx*brick_size + x, j = by*brick_size + y, k = bz*brick_size + z;
+                float value = 0;
+                if (i < voxel_count[0] && j < voxel_count[1] && k < voxel_count[2])
+                    value = std::max(0.0f, float(density(voxel_centre(i, j, k))));
+                brick[(z*brick_size + y)*brick_size + x] = value;
+                occupied = occupied || value > 0;
+            }
+            auto& offset = brick_offset[brick_index(bx, by, bz)];
+            offset = -1;
+            if (occupied) {
+                offset = int(voxels.size() / voxels_per_brick);
+                voxels.insert(voxels.end(), brick.begin(), brick.end());
+            }
+        }
+        build_majorants();
+    }
+
+    // Trilinear interpolation between voxel centres, fading to zero over the outermost half voxel
+    double density(const point3& p) const {
+        double g[3];
+        int i[3];
+        for (int a = 0; a < 3; a++) {
+            g[a] = (p[a] - bounds.axis_interval(a).min) / voxel_size[a] - 0.5;
+            i[a] = int(std::floor(g[a]));
+            g[a] -= i[a];
+        }
+        double result = 0;
+        for (int dz = 0; dz < 2; dz++)
+        for (int dy = 0; dy < 2; dy++)
+        for (int dx = 0; dx < 2; dx++) {
+            double weight = (dx ? g[0] : 1 - g[0]) * (dy ? g[1] : 1 - g[1]) * (dz ? g[2] : 1 - g[2]);
+            result += weight * voxel(i[0] + dx, i[1] + dy, i[2] + dz);
+        }
+        return result;
+    }
+
+    const aabb& bounding_box() const { return bounds; }
+
+    // Bricks holding voxels, out of brick_total()
+    size_t stored_bricks() const { return voxels.size() / (brick_size * brick_size * brick_size); }
+    size_t brick_total() const { return brick_offset.size(); }
+
+    // Memory taken by the bricks and the tables over them
+    size_t bytes() const {
+        return sizeof(density_grid) + brick_offset.capacity() * sizeof(int)
+             + (voxels.capacity() + brick_majorant.capacity() + coarse_majorant.capacity()) * sizeof(float);
+    }
+
+    // Calls visit(t0, t1, majorant) for each brick with density that the ray passes through between t_min
+    // and t_max, in order along the ray, until visit returns false
+    template <typename Visit>
+    void march(const ray& r, double t_min, double t_max, Visit visit) const {
+        // in voxel units from the grid's corner, t is the same as along the ray
+        double origin[3], direction[3];
+        for (int a = 0; a < 3; a++) {
+            origin[a] = (r.origin()[a] - bounds.axis_interval(a).min) / voxel_size[a];
+            direction[a] = r.direction()[a] / voxel_size[a];
+            if (direction[a] == 0) {
+                if (origin[a] < 0 || origin[a] > voxel_count[a])
+                    return;
+                continue;
+            }
+            double t0 = -origin[a] / direction[a], t1 = (voxel_count[a] - origin[a]) / direction[a];
+            t_min = std::max(t_min, std::min(t0, t1));
+            t_max = std::min(t_max, std::max(t0, t1));
+        }
+        if (t_min >= t_max)
+            return;
+
+        walk(origin, direction, t_min, t_max, brick_size * coarse_bricks, coarse_count, [&](const int* cell, double t0, double t1) {
+            if (coarse_majorant[(size_t(cell[2]) * coarse_count[1] + cell[1]) * coarse_count[0] + cell[0]] <= 0)
+                return true;// nothing anywhere in this cell
+            return walk(origin, direction, t0, t1, brick_size, brick_count, [&](const int* brick, double ta, double tb) {
+                float majorant = brick_majorant[brick_index(brick[0], brick[1], brick[2])];
+                return majorant <= 0 || visit(ta, tb, double(majorant));
+            });
+        });
+    }
+
+  private:
+    aabb bounds;
+    int voxel_count[3];
+    double voxel_size[3];
+    int brick_count[3];
+    int coarse_count[3];
+    std::vector<int> brick_offset;       // Index of each brick's voxels in voxels, -1 if the brick is empty
+    std::vector<float> voxels;           // Stored bricks one after another, x fastest inside a brick
+    std::vector<float> brick_majorant;   // Most density any point in the brick can be interpolated to
+    std::vector<float> coarse_majorant;  // Largest majorant of the bricks in each coarse cell
+
+    size_t brick_index(int bx, int by, int bz) const {
+        return (size_t(bz) * brick_count[1] + by) * brick_count[0] + bx;
+    }
+
+    point3 voxel_centre(int i, int j, int k) const {
+        return point3(bounds.x.min + (i + 0.5) * voxel_size[0],
+                      bounds.y.min + (j + 0.5) * voxel_size[1],
+                      bounds.z.min + (k + 0.5) * voxel_size[2]);
+    }
+
+    float voxel(int i, int j, int k) const {
+        if (i < 0 || j < 0 || k < 0 || i >= voxel_count[0] || j >= voxel_count[1] || k >= voxel_count[2])
+            return 0;
+        int offset = brick_offset[brick_index(i / brick_size, j / brick_size, k / brick_size)];
+        if (offset < 0)
+            return 0;
+        return voxels[size_t(offset) * brick_size * brick_size * brick_size
+                      + ((k % brick_size) * brick_size + j % brick_size) * brick_size + i % brick_size];
+    }
+
+    void build_majorants() {
+        std::fill(coarse_majorant.begin(), coarse_majorant.end(), 0.0f);
+        for (int bz = 0; bz < brick_count[2]; bz++)
+        for (int by = 0; by < brick_count[1]; by++)
+        for (int bx = 0; bx < brick_count[0]; bx++) {
+            // interpolating anywhere in the brick reaches one voxel into the bricks around it
+            float majorant = 0;
+            for (int k = bz*brick_size - 1; k <= (bz + 1)*brick_size; k++)
+            for (int j = by*brick_size - 1; j <= (by + 1)*brick_size; j++)
+            for (int i = bx*brick_size - 1; i <= (bx + 1)*brick_size; i++)
+                majorant = std::max(majorant, voxel(i, j, k));
+            brick_majorant[brick_index(bx, by, bz)] = majorant;
+
+            auto& coarse = coarse_majorant[(size_t(bz / coarse_bricks) * coarse_count[1] + by / coarse_bricks) * coarse_count[0] + bx / coarse_bricks];
+            coarse = std::max(coarse, majorant);
+        }
+    }
+
+    // Steps through the cells of cell_size voxels that the ray passes through between t0 and t1, calling
+    // step(cell, ta, tb) for each until it returns false, which returns false too
+    template <typename Step>
+    static bool walk(const double* origin, const double* direction, double t0, double t1, int cell_size, const int* cell_count, Step step) {
+        int cell[3], cell_step[3];
+        double t_next[3], t_delta[3];
+        for (int a = 0; a < 3; a++) {
+            double p = origin[a] + direction[a] * t0;
+            cell[a] = std::clamp(int(std::floor(p / cell_size)), 0, cell_count[a] - 1);
+            if (direction[a] > 0) {
+                cell_step[a] = 1;
+                t_next[a] = ((cell[a] + 1) * double(cell_size) - origin[a]) / direction[a];
+                t_delta[a] = cell_size / direction[a];
+            } else if (direction[a] < 0) {
+                cell_step[a] = -1;
+                t_next[a] = (cell[a] * double(cell_size) - origin[a]) / direction[a];
+                t_delta[a] = -cell_size / direction[a];
+            } else {
+                cell_step[a] = 0;
+                t_next[a] = t_delta[a] = INF;
+            }
+        }
+
+        double ta = t0;
+        while (ta < t1) {
+            int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            double tb = std::min(t_next[axis], t1);
+            if (!step(cell, ta, tb))
+                return false;
+            ta = tb;
+            cell[axis] += cell_step[axis];
+            if (cell[axis] < 0 || cell[axis] >= cell_count[axis])
+                break;
+            t_next[axis] += t_delta[axis];
+        }
+        return true;
+    }
+};
+
+class grid_medium : public hittable {
+  public:
+    // The medium fills the boundary with the grid's density, the grid usually covers the boundary's bounding box
+    grid_medium(shared_ptr<hittable> boundary, shared_ptr<density_grid> grid, shared_ptr<texture> tex)
+      : boundary(boundary), grid(grid), phase_function(make_shared<isotropic>(tex))
+    {}
+    grid_medium(shared_ptr<hittable> boundary, shared_ptr<density_grid> grid, const colour& albedo)
+      : boundary(boundary), grid(grid), phase_function(make_shared<isotropic>(albedo))
+    {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& record) const override {
+        RT_STAT(medium_tests);
+        thread_local std::vector<interval> spans;
+        boundary->hit_span(r, interval(std::fmax(ray_t.min, 0), ray_t.max), spans);
+
+        // delta tracking, a tentative collision is sampled from the brick's majorant and is a real one
+        // with probability density / majorant, otherwise tracking carries on from it
+        double ray_length = r.direction().length();
+        bool collided = false;
+        for (size_t s = 0; s < spans.size() && !collided; s++) {
+            grid->march(r, spans[s].min, spans[s].max, [&](double ta, double tb, double majorant) {
+                for (double t = ta;;) {
+                    t -= std::log(1 - random_double()) / (majorant * ray_length);
+                    if (t >= tb)
+                        return true;// on to the next brick
+                    if (random_double() * majorant < grid->density(r.at(t))) {
+                        record.t = t;
+                        collided = true;
+                        return false;
+                    }
+                }
+            });
+        }
+        if (!collided)
+            return false;
+
+        record.p = r.at(record.t);
+        record.normal = vec3(1,0,0);  // arbitrary
+        record.front_face = true;     // also arbitrary
+        record.uv_scale = 0;
+        record.mat = phase_function;
+        record.object_id = object_id;
+        return true;
+    }
+
+    bool hit_surface(const ray& r, interval ray_t, hit_record& record) const override { return false; }
+
+    // Fraction of the light that gets through the medium along the ray in ray_t, estimated by ratio
+    // tracking: the estimate is multiplied by 1 - density / majorant at each tentative collision
+    // instead of stopping at the first real one, so it's never a hard zero or one. Once it's small
+    // it is either dropped or doubled with even odds, which keeps it unbiased
+    double transmittance(const ray& r, interval ray_t) const override {
+        RT_STAT(medium_tests);
+        thread_local std::vector<interval> spans;
+        boundary->hit_span(r, interval(std::fmax(ray_t.min, 0), ray_t.max), spans);
+
+        double ray_length = r.direction().length();
+        double result = 1;
+        for (size_t s = 0; s < spans.size() && result > 0; s++) {
+            grid->march(r, spans[s].min, spans[s].max, [&](double ta, double tb, double majorant) {
+                for (double t = ta;;) {
+                    t -= std::log(1 - random_double()) / (majorant * ray_length);
+                    if (t >= tb)
+                        return true;
+                    result *= 1 - grid->density(r.at(t)) / majorant;
+                    if (result < 1e-3) {
+                        if (random_double() < 0.5) {
+                            result = 0;
+                            return false;
+                        }
+                        result *= 2;
+                    }
+                }
+            });
+        }
+        return result;
+    }
+
+    aabb bounding_box() const override { return boundary->bounding_box(); }
+
+    void measure(memory_usage& usage) const override {
+        usage.geometry += sizeof(grid_medium);
+        if (usage.first_visit(grid.get())) {// media can share a grid
+            usage.geometry += grid->bytes();
+            usage.control_blocks += memory_usage::control_block_size;// grids are made with make_shared
+        }
+        measure_object(boundary, usage);
+    }
+
+  private:
+    shared_ptr<hittable> boundary;
+    shared_ptr<density_grid> grid;
+    shared_ptr<material> phase_function;
+};
+
+#endif
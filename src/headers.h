@@ -2,10 +2,12 @@
 #define RTWEEKEND_H
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <random>
 
 
 // C++ Std Usings
@@ -44,8 +46,17 @@ inline T lerp(T start, T end, double at){
     return (1.0-at)*start + at*end;
 }
 
+inline std::mt19937& random_generator() {// each thread draws from its own generator
+    thread_local std::mt19937 generator;
+    return generator;
+}
+
+inline void seed_random(unsigned int seed) {// reseed the calling thread's generator
+    random_generator().seed(seed);
+}
+
 inline double random_double() {// random 0 to 1
-    return rand() / (RAND_MAX + 1.0);
+    return random_generator()() / 4294967296.0;
 }
 
 inline double random_double(double min, double max) {// random min to max
@@ -56,6 +67,16 @@ inline int random_int(int min, int max) {// random min to max
     return int(random_double(min, max+1));
 }
 
+// 64 bit FNV-1a hash, continued from a previous hash value
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
 
 // Common Headers
 
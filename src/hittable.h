@@ -4,6 +4,12 @@
 #include "headers.h"
 
 #include "aabb.h"
+#include "flat_scene.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
 
 class material;
 
@@ -15,6 +21,9 @@ class hit_record {//data for a hit, to simplify function parameters
     bool front_face;
     shared_ptr<material> mat;//material of hit object
     double u,v;//surface coords of the hit
+    double uv_scale = 0;//uv units per world unit across the surface at the hit, 0 if the primitive doesn't know
+    double uv_footprint = 0;//width in uv units of the ray's cone where it hit, set by the camera for texture filtering
+    int object_id = -1;//id of the primitive that was hit
     void set_face_normal(const ray& r, const vec3& outward_normal) {//outward_normal is assumed to have unit length.
         front_face = dot(r.direction(), outward_normal) < 0;//if dot product of ray and outward normal is positive then its inside the sphere
         normal = front_face ? outward_normal : -outward_normal;
@@ -23,13 +32,70 @@ class hit_record {//data for a hit, to simplify function parameters
 
 class hittable {
   public:
+    hittable() : object_id(next_object_id()) {}
     virtual ~hittable() = default;
 
+    int object_id;// unique id of the object, primitives write it to the hit record
+
     // virtal function that tests if the ray hits objects
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;// ray interval restricts t to between a min and max
     //get the bounding box for this object
     virtual aabb bounding_box() const = 0;
 
+    // recompute any cached bounds after the wrapped geometry has moved, primitives with fixed bounds do nothing
+    virtual void refit() {}
+
+    // appends the t of every point in ray_t where the ray crosses the surface, in any order and without
+    // filling in hit records. Returns false if the object can't list them, hit_span falls back to hit then
+    virtual bool surface_crossings(const ray& r, interval ray_t, std::vector<double>& crossings) const {
+        return false;
+    }
+
+    // Entry and exit t of each stretch of ray_t that is inside the object, in order along the ray. The
+    // ray is inside between its first and second crossing of the surface along the whole line, its third
+    // and fourth and so on, so the object has to be closed but doesn't have to be convex
+    void hit_span(const ray& r, interval ray_t, std::vector<interval>& spans) const {
+        thread_local std::vector<double> crossings;// kept so queries don't allocate
+        // crossings closer than this along the ray are the same one, in units of t so it's the
+        // same distance however long the ray's direction is
+        double same_crossing = 0.0001 / r.direction().length();
+        crossings.clear();
+        if (!surface_crossings(r, interval::universe, crossings)) {
+            crossings.clear();
+            hit_record rec;
+            for (double t = -INF; crossings.size() < 64 && hit(r, interval(t, INF), rec); t = rec.t + same_crossing)
+                crossings.push_back(rec.t);
+        }
+        std::sort(crossings.begin(), crossings.end());
+        // a ray through an edge crosses both faces that meet there at the same point, which is one crossing
+        crossings.erase(std::unique(crossings.begin(), crossings.end(), [&](double a, double b) { return b - a < same_crossing; }),
+                        crossings.end());
+
+        spans.clear();
+        for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+            interval span(std::max(crossings[i], ray_t.min), std::min(crossings[i + 1], ray_t.max));
+            if (span.min < span.max)
+                spans.push_back(span);
+        }
+    }
+
+    // hit for shadow rays, which stop at the closest surface and go through media, the light the
+    // media let through is left to transmittance. Media return false
+    virtual bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const {
+        return hit(r, ray_t, rec);
+    }
+
+    // Fraction of the light along the ray in ray_t that gets through the media in the object, for
+    // shadow rays. Surfaces let all of it through, they stop shadow rays in hit_surface instead
+    virtual double transmittance(const ray& r, interval ray_t) const {
+        return 1;
+    }
+
+    // write this object as world space primitive records, returns false if it can't be flattened
+    virtual bool flatten(scene_writer& writer) const {
+        return false;
+    }
+
 	//get the pdf value from a given direction
 	virtual double pdf_value(const point3& origin, const vec3& direction) const {
         return 0.0;
@@ -39,6 +105,24 @@ class hittable {
     virtual vec3 random(const point3& origin) const {
         return vec3(1,0,0);
     }
+
+    // adds the bytes of this object and of the objects it holds to usage
+    virtual void measure(memory_usage& usage) const {}
+
+  protected:
+    // measures an object this one holds, with its control block, unless usage has already counted it
+    static void measure_object(const shared_ptr<hittable>& object, memory_usage& usage) {
+        if (object == nullptr || !usage.first_visit(object.get()))
+            return;
+        usage.control_blocks += memory_usage::control_block_size;
+        object->measure(usage);
+    }
+
+  private:
+    static int next_object_id() {
+        static std::atomic<int> next_id(0);
+        return next_id++;
+    }
 };
 
 class translate : public hittable{
@@ -64,8 +148,43 @@ class translate : public hittable{
       	return true;
     }
 
+	bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const override {
+		if (!object->hit_surface(ray(r.origin() - offset, r.direction(), r.time()), ray_t, rec))
+			return false;
+		rec.p += offset;
+		return true;
+	}
+
+	double transmittance(const ray& r, interval ray_t) const override {
+		return object->transmittance(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+	}
+
+	bool surface_crossings(const ray& r, interval ray_t, std::vector<double>& crossings) const override {
+		return object->surface_crossings(ray(r.origin() - offset, r.direction(), r.time()), ray_t, crossings);
+	}
+
 	aabb bounding_box() const override { return bbox; }
 
+	// move the object to a new offset, the bounds are updated on the next refit
+	void set_offset(const vec3& new_offset) { offset = new_offset; }
+
+	bool flatten(scene_writer& writer) const override {
+		writer.push_translate(offset);
+		bool flattened = object->flatten(writer);
+		writer.pop_transform();
+		return flattened;
+	}
+
+	void refit() override {
+		object->refit();
+		bbox = object->bounding_box() + offset;
+	}
+
+	void measure(memory_usage& usage) const override {
+		usage.geometry += sizeof(translate);
+		measure_object(object, usage);
+	}
+
   private:
 	shared_ptr<hittable> object;
 	vec3 offset;
@@ -75,9 +194,36 @@ class translate : public hittable{
 class rotate_y : public hittable {
   public:
   	rotate_y(shared_ptr<hittable> object, double angle) : object(object) {
+		set_angle(angle);
+		set_bounding_box();
+	}
+
+	// rotate the object to a new angle, the bounds are updated on the next refit
+	void set_angle(double angle) {
 		auto radians = degrees_to_radians(angle);
 		sin_theta = std::sin(radians);
 		cos_theta = std::cos(radians);
+	}
+
+	void refit() override {
+		object->refit();
+		set_bounding_box();
+	}
+
+	void measure(memory_usage& usage) const override {
+		usage.geometry += sizeof(rotate_y);
+		measure_object(object, usage);
+	}
+
+	bool flatten(scene_writer& writer) const override {
+		writer.push_rotate_y(sin_theta, cos_theta);
+		bool flattened = object->flatten(writer);
+		writer.pop_transform();
+		return flattened;
+	}
+
+	// bounds of the rotated object's bounding box corners
+	void set_bounding_box() {
 		bbox = object->bounding_box();
 
 		point3 min( INF,  INF,  INF);
@@ -109,27 +255,42 @@ class rotate_y : public hittable {
 
 		// Transform the ray from world space to object space.
 
-		auto origin = point3(
-			(cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
-			r.origin().y(),
-			(sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
-		);
-
-		auto direction = vec3(
-			(cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
-			r.direction().y(),
-			(sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
-		);
-
-		ray rotated_r(origin, direction, r.time());
+		ray rotated_r = to_object_space(r);
 
 		// Determine whether an intersection exists in object space (and if so, where).
 
 		if (!object->hit(rotated_r, ray_t, rec))
 			return false;
 
-		// Transform the intersection from object space back to world space.
+		to_world_space(rec);
+		return true;
+	}
+
+	bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const override {
+		if (!object->hit_surface(to_object_space(r), ray_t, rec))
+			return false;
+		to_world_space(rec);
+		return true;
+	}
+
+	double transmittance(const ray& r, interval ray_t) const override {
+		return object->transmittance(to_object_space(r), ray_t);
+	}
+
+	bool surface_crossings(const ray& r, interval ray_t, std::vector<double>& crossings) const override {
+		return object->surface_crossings(to_object_space(r), ray_t, crossings);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+  private:
+	shared_ptr<hittable> object;
+	double sin_theta;
+	double cos_theta;
+	aabb bbox;
 
+	// Transform the intersection from object space back to world space.
+	void to_world_space(hit_record& rec) const {
 		rec.p = point3(
 			(cos_theta * rec.p.x()) + (sin_theta * rec.p.z()),
 			rec.p.y(),
@@ -141,15 +302,22 @@ class rotate_y : public hittable {
 			rec.normal.y(),
 			(-sin_theta * rec.normal.x()) + (cos_theta * rec.normal.z())
 		);
-
-		return true;
 	}
-	aabb bounding_box() const override { return bbox; }
 
-  private:
-	shared_ptr<hittable> object;
-	double sin_theta;
-	double cos_theta;
-	aabb bbox;
+	ray to_object_space(const ray& r) const {
+		auto origin = point3(
+			(cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
+			r.origin().y(),
+			(sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
+		);
+
+		auto direction = vec3(
+			(cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
+			r.direction().y(),
+			(sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
+		);
+
+		return ray(origin, direction, r.time());
+	}
 };
 #endif
\ No newline at end of file
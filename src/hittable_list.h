@@ -38,8 +38,59 @@ class hittable_list : public hittable {
 
         return hit_anything;
     }
+    bool hit_surface(const ray& r, interval ray_t, hit_record& rec) const override {
+        hit_record temp_rec;
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+
+        for (const auto& object : hittable_objects) {
+            if (object->hit_surface(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+                hit_anything = true;
+                closest_so_far = temp_rec.t;
+                rec = temp_rec;
+            }
+        }
+
+        return hit_anything;
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        double result = 1;
+        for (size_t i = 0; i < hittable_objects.size() && result > 0; i++)
+            result *= hittable_objects[i]->transmittance(r, ray_t);
+        return result;
+    }
+
     aabb bounding_box() const override { return bbox; }//get the bounding box of the objects in the list
 
+    bool surface_crossings(const ray& r, interval ray_t, std::vector<double>& crossings) const override {
+        for (const auto& object : hittable_objects)
+            if (!object->surface_crossings(r, ray_t, crossings))
+                return false;
+        return true;
+    }
+
+    void refit() override {//refits every object then recalculates the combined bounding box
+        bbox = aabb();
+        for (const auto& object : hittable_objects) {
+            object->refit();
+            bbox = aabb(bbox, object->bounding_box());
+        }
+    }
+
+    bool flatten(scene_writer& writer) const override {
+        for (const auto& object : hittable_objects)
+            if (!object->flatten(writer))
+                return false;
+        return true;
+    }
+
+    void measure(memory_usage& usage) const override {
+        usage.geometry += sizeof(hittable_list) + hittable_objects.capacity() * sizeof(shared_ptr<hittable>);
+        for (const auto& object : hittable_objects)
+            measure_object(object, usage);
+    }
+
     double pdf_value(const point3& origin, const vec3& direction) const override {
         auto weight = 1.0 / hittable_objects.size();
         auto sum = 0.0;
@@ -10,57 +10,108 @@
 #define STBI_FAILURE_USERMSG
 #include "external/stb_image.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
 class rtw_image {
   public:
     rtw_image() {}
 
     rtw_image(const char* image_filename) {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
-
-        auto filename = std::string(image_filename);
-        auto imagedir = getenv("RTW_IMAGES");
-
-        // Hunt for the image file in some likely locations.
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-
-        std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+        open(image_filename);
     }
 
+    rtw_image(const rtw_image&) = delete;
+    rtw_image& operator=(const rtw_image&) = delete;
+
     ~rtw_image() {
-        delete[] bdata;
-        STBI_FREE(fdata);
+        STBI_FREE(bdata);
+    }
+
+    // Hunts for the image file in some likely locations and returns the first path that can be
+    // opened, or an empty string. If the RTW_IMAGES environment variable is defined that
+    // directory is tried first, then the current directory, then the images/ subdirectory, then
+    // the _parent's_ images/ subdirectory, and then _that_ parent's.
+    static std::string locate(const std::string& filename) {
+        std::vector<std::string> candidates;
+        if (auto imagedir = getenv("RTW_IMAGES"))
+            candidates.push_back(std::string(imagedir) + "/" + filename);
+        candidates.push_back(filename);
+        candidates.push_back("images/" + filename);
+        candidates.push_back("../images/" + filename);
+        candidates.push_back("../../images/" + filename);
+
+        for (const auto& candidate : candidates)
+            if (std::ifstream(candidate, std::ios::binary))
+                return candidate;
+        return std::string();
+    }
+
+    bool open(const std::string& image_filename) {
+        // Loads image data from the file found by locate(). If the image was not loaded
+        // successfully, width() and height() will return 0.
+
+        auto path = locate(image_filename);
+        if (!path.empty() && load(path))
+            return true;
+        std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+        return false;
     }
 
     bool load(const std::string& filename) {
         // Loads the linear (gamma=1) image data from the given file name. Returns true if the
-        // load succeeded. The resulting data buffer contains the three [0.0, 1.0]
-        // floating-point values for the first pixel (red, then green, then blue). Pixels are
-        // contiguous, going left to right for the width of the image, followed by the next row
-        // below, for the full height of the image.
+        // load succeeded. 8-bit images are decoded straight to bytes and linearized in place,
+        // only HDR images go through floating point pixels, which are converted to bytes and
+        // freed. Pixels are contiguous, going left to right for the width of the image, followed
+        // by the next row below, for the full height of the image.
 
         auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-        if (fdata == nullptr) return false;
+        if (stbi_is_hdr(filename.c_str())) {
+            float* fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+            if (fdata == nullptr) return false;
+            convert_to_bytes(fdata);
+            STBI_FREE(fdata);
+        } else {
+            bdata = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+            if (bdata == nullptr) return false;
+            linearize_bytes();
+        }
 
         bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
+        build_mip_levels();
         return true;
     }
 
-    int width()  const { return (fdata == nullptr) ? 0 : image_width; }
-    int height() const { return (fdata == nullptr) ? 0 : image_height; }
+    int width()  const { return (bdata == nullptr) ? 0 : image_width; }
+    int height() const { return (bdata == nullptr) ? 0 : image_height; }
+
+    // Mip levels, level 0 is the image and each level after it is half the size of the one before
+    // down to a single pixel
+    int level_count() const { return 1 + int(mip_levels.size()); }
+    int width(int level)  const { return level == 0 ? width()  : mip_levels[level - 1].width; }
+    int height(int level) const { return level == 0 ? height() : mip_levels[level - 1].height; }
+
+    // Memory taken by the pixels of all the levels
+    size_t bytes() const {
+        size_t total = (bdata == nullptr) ? 0 : size_t(image_height) * bytes_per_scanline;
+        for (const auto& mip : mip_levels)
+            total += mip.data.capacity();
+        return total;
+    }
+
+    const unsigned char* pixel_data(int x, int y, int level) const {
+        if (level == 0)
+            return pixel_data(x, y);
+        const auto& mip = mip_levels[level - 1];
+        x = clamp(x, 0, mip.width);
+        y = clamp(y, 0, mip.height);
+        return mip.data.data() + (size_t(y)*mip.width + x)*bytes_per_pixel;
+    }
 
     const unsigned char* pixel_data(int x, int y) const {
         // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
@@ -76,12 +127,17 @@ class rtw_image {
 
   private:
     const int      bytes_per_pixel = 3;
-    float         *fdata = nullptr;         // Linear floating point pixel data
-    unsigned char *bdata = nullptr;         // Linear 8-bit pixel data
+    unsigned char *bdata = nullptr;         // Linear 8-bit pixel data, allocated by stb
     int            image_width = 0;         // Loaded image width
     int            image_height = 0;        // Loaded image height
     int            bytes_per_scanline = 0;
 
+    struct mip_level {
+        int width, height;
+        std::vector<unsigned char> data;
+    };
+    std::vector<mip_level> mip_levels;      // Levels after the first, which is bdata
+
     static int clamp(int x, int low, int high) {
         // Return the value clamped to the range [low, high).
         if (x < low) return low;
@@ -97,12 +153,12 @@ class rtw_image {
         return static_cast< unsigned char >(256.0 * value);
     }
 
-    void convert_to_bytes() {
+    void convert_to_bytes(const float* fdata) {
         // Convert the linear floating point pixel data to bytes, storing the resulting byte
         // data in the `bdata` member.
 
         int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
+        bdata = static_cast<unsigned char*>(STBI_MALLOC(total_bytes));
 
         // Iterate through all pixel components, converting from [0.0, 1.0] float values to
         // unsigned [0, 255] byte values.
@@ -112,6 +168,51 @@ class rtw_image {
         for (auto i=0; i < total_bytes; i++, fptr++, bptr++)
             *bptr = float_to_byte(*fptr);
     }
+
+    void linearize_bytes() {
+        // Map the gamma encoded bytes to the same linear bytes that decoding to floats and
+        // converting those would give: stb raises each value to the power 2.2 when it decodes
+        // 8-bit images to floats.
+        static const auto linear = [] {
+            std::vector<unsigned char> table(256);
+            for (int i = 0; i < 256; i++)
+                table[i] = float_to_byte(float(std::pow(i / 255.0f, 2.2f)));
+            return table;
+        }();
+
+        int total_bytes = image_width * image_height * bytes_per_pixel;
+        for (int i = 0; i < total_bytes; i++)
+            bdata[i] = linear[bdata[i]];
+    }
+
+    void build_mip_levels() {
+        // Each texel is the average of the 2x2 texels under it in the level before, an odd row or
+        // column at the edge is averaged into the texels beside it
+        mip_levels.clear();
+        int level = 0;
+        while (width(level) > 1 || height(level) > 1) {
+            mip_level next;
+            next.width = std::max(1, width(level) / 2);
+            next.height = std::max(1, height(level) / 2);
+            next.data.resize(size_t(next.width) * next.height * bytes_per_pixel);
+            for (int y = 0; y < next.height; y++) {
+                for (int x = 0; x < next.width; x++) {
+                    int x0 = x * width(level) / next.width, x1 = (x + 1) * width(level) / next.width;
+                    int y0 = y * height(level) / next.height, y1 = (y + 1) * height(level) / next.height;
+                    for (int c = 0; c < bytes_per_pixel; c++) {
+                        int sum = 0;
+                        for (int sy = y0; sy < y1; sy++)
+                            for (int sx = x0; sx < x1; sx++)
+                                sum += pixel_data(sx, sy, level)[c];
+                        int count = (x1 - x0) * (y1 - y0);
+                        next.data[(size_t(y)*next.width + x)*bytes_per_pixel + c] = (unsigned char)((sum + count/2) / count);
+                    }
+                }
+            }
+            mip_levels.push_back(std::move(next));
+            level++;
+        }
+    }
 };
 
 // Restore MSVC compiler warnings
@@ -0,0 +1,79 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include "headers.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Float image files for the extra render outputs, written as PFM which keeps the full range of
+// the values. PFM stores rows from the bottom of the image up in little endian floats.
+
+inline bool write_pfm(const std::string& filename, int width, int height, int channels, const float* data) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "ERROR: Could not open output file '" << filename << "'.\n";
+        return false;
+    }
+    out << (channels == 3 ? "PF" : "Pf") << "\n" << width << " " << height << "\n-1.0\n";// negative scale is little endian
+
+    std::vector<unsigned char> row(size_t(width) * channels * 4);
+    for (int j = height - 1; j >= 0; j--) {
+        const float* src = data + size_t(j) * width * channels;
+        for (int i = 0; i < width * channels; i++) {
+            uint32_t bits;
+            std::memcpy(&bits, &src[i], 4);
+            row[i*4 + 0] = bits & 0xff;
+            row[i*4 + 1] = (bits >> 8) & 0xff;
+            row[i*4 + 2] = (bits >> 16) & 0xff;
+            row[i*4 + 3] = (bits >> 24) & 0xff;
+        }
+        out.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+    return bool(out);
+}
+
+// single channel image
+inline bool write_pfm(const std::string& filename, int width, int height, const std::vector<float>& values) {
+    return write_pfm(filename, width, height, 1, values.data());
+}
+
+// three channel image from colours
+inline bool write_pfm(const std::string& filename, int width, int height, const std::vector<colour>& pixels) {
+    std::vector<float> values(pixels.size() * 3);
+    for (size_t i = 0; i < pixels.size(); i++)
+        for (int c = 0; c < 3; c++)
+            values[i*3 + c] = float(pixels[i][c]);
+    return write_pfm(filename, width, height, 3, values.data());
+}
+
+// binary ppm of colours already in the [0,1] display range, without gamma correction
+inline bool write_ppm(const std::string& filename, int width, int height, const std::vector<colour>& pixels) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "ERROR: Could not open output file '" << filename << "'.\n";
+        return false;
+    }
+    out << "P6\n" << width << " " << height << "\n255\n";
+    static const interval intensity(0.000, 0.999);
+    for (const auto& pixel : pixels)
+        for (int c = 0; c < 3; c++)
+            out.put(char(int(256 * intensity.clamp(pixel[c]))));
+    return bool(out);
+}
+
+// false colour ramp from black through blue, red and yellow to white for values in [0,1]
+inline colour heatmap_colour(double value) {
+    static const colour ramp[] = {
+        colour(0, 0, 0), colour(0, 0, 1), colour(1, 0, 0), colour(1, 1, 0), colour(1, 1, 1)
+    };
+    value = interval(0, 1).clamp(value) * 4;
+    int index = std::min(int(value), 3);
+    return lerp(ramp[index], ramp[index + 1], value - index);
+}
+
+#endif
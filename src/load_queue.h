@@ -0,0 +1,119 @@
+#ifndef LOAD_QUEUE_H
+#define LOAD_QUEUE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Pool of threads for slow loading work, like decoding images, that can go on while the scene
+// is still being parsed and its BVH built. Jobs run in the order they were submitted, the pool's
+// threads start with the first job and stay until the program exits. A process forked after the
+// threads started (a local worker of a distributed render) doesn't have them, so it runs its jobs
+// as they are submitted instead.
+
+class load_queue {
+  public:
+    load_queue() {}
+    load_queue(const load_queue&) = delete;
+    load_queue& operator=(const load_queue&) = delete;
+
+    ~load_queue() {
+        if (forked()) {// the threads are the parent's and can't be joined, left alone instead of destroyed
+            new std::vector<std::thread>(std::move(threads));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        job_ready.notify_all();
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    static load_queue& global() {
+        static load_queue queue;
+        return queue;
+    }
+
+    // Queues the job and returns a future that is ready once it has run
+    std::shared_future<void> submit(std::function<void()> job) {
+        std::packaged_task<void()> task(std::move(job));
+        std::shared_future<void> done = task.get_future().share();
+        if (forked()) {
+            task();
+            return done;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (threads.empty()) {
+                int count = std::max(1, int(std::thread::hardware_concurrency()));
+                for (int i = 0; i < count; i++)
+                    threads.emplace_back([this] { run(); });
+            }
+            jobs.push_back(std::move(task));
+            unfinished++;
+        }
+        job_ready.notify_one();
+        return done;
+    }
+
+    // Waits until every job submitted so far has run
+    void wait() {
+        if (forked())// its jobs have all run already
+            return;
+        std::unique_lock<std::mutex> lock(mutex);
+        all_done.wait(lock, [this] { return unfinished == 0; });
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable job_ready;
+    std::condition_variable all_done;
+    std::deque<std::packaged_task<void()>> jobs;
+    std::vector<std::thread> threads;
+    int unfinished = 0;// queued or running
+    bool stopping = false;
+#ifndef _WIN32
+    pid_t owner = getpid();// process the threads were started in
+#endif
+
+    bool forked() const {
+#ifndef _WIN32
+        return getpid() != owner;
+#else
+        return false;
+#endif
+    }
+
+    void run() {
+        while (true) {
+            std::packaged_task<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                job_ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                task = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                unfinished--;
+            }
+            all_done.notify_all();
+        }
+    }
+};
+
+#endif
@@ -2,216 +2,394 @@
 
 #include "bvh.h"
 #include "camera.h"
-#include "constant_medium_volume.h"
+#include "distributed.h"
+#include "render_server.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
 #include "quad.h"
+#include "scene_cache.h"
+#include "scene_loader.h"
 #include "sphere.h"
-#include "texture.h"
 #include <chrono>
-/*void quads() {
-    hittable_list world;
-
-    // Materials
-    auto left_red     = make_shared<lambertian>(colour(1.0, 0.2, 0.2));
-    auto back_green   = make_shared<lambertian>(colour(0.2, 1.0, 0.2));
-    auto right_blue   = make_shared<lambertian>(colour(0.2, 0.2, 1.0));
-    auto upper_orange = make_shared<lambertian>(colour(1.0, 0.5, 0.0));
-    auto lower_teal   = make_shared<lambertian>(colour(0.2, 0.8, 0.8));
-
-    // Quads
-    world.add(make_shared<quad>(point3(-3,-2, 5), vec3(0, 0,-4), vec3(0, 4, 0), left_red));
-    world.add(make_shared<triangle>(point3(-2,-2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
-    world.add(make_shared<annulus>(point3( 3,-2, 1), vec3(0, 0, 4), vec3(0, 4, 0),0.6, right_blue));
-    world.add(make_shared<ellipse>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
-    world.add(make_shared<quad>(point3(-2,-3, 5), vec3(4, 0, 0), vec3(0, 0,-4), lower_teal));
-
-    camera cam;
-
-    cam.aspect_ratio      = 1.0;
-    cam.image_width       = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth         = 50;
-
-    cam.fov     = 80;
-    cam.cam_center = point3(0,0,9);
-    cam.look_point   = point3(0,0,0);
-    cam.vup      = vec3(0,1,0);
-
-    cam.defocus_angle = 0;
-    cam.background_colour = colour(.7, .8, 1.0);
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+// Render settings from the command line, these override the values in the scene file
+struct render_options {
+    const char* scene_file = "scenes/cornell_box.scene";
+    const char* cache_dir = nullptr;// trace from a mapped scene cache in this directory
+    const char* texture_cache_dir = nullptr;// page image textures in by tiles from tiled copies in this directory
+    double texture_memory = 256;// MiB of texture tiles kept in memory
+    const char* output_file = nullptr;// stdout if not given
+    int animate_frames = 0;
+    int samples_per_pixel = 0;// 0 keeps the scene's value
+    int image_width = 0;
+    int image_height = 0;
+    int thread_count = int(std::thread::hardware_concurrency());
+    unsigned int seed = 0;
+    bool profile = false;// write per pixel cost images next to the output image
+    bool aovs = false;// write first hit albedo, normal, depth and object id images next to the output image
+    bool denoise = false;
+    bool wavefront = false;// trace each tile's samples together a bounce at a time
+    bool memory = false;// print the memory the scene and the render take after loading it and after rendering
+    double memory_budget = 0;// MiB the scene and the render may take, 0 for no limit
+    int pass_samples = 0;// samples per pixel in each progressive pass, 0 renders in one pass
+    const char* checkpoint_file = nullptr;
+    double checkpoint_seconds = 60;
+    double time_budget = 0;// seconds to keep refining the image for, instead of a fixed sample count
+    int worker_count = -1;// coordinate a distributed render with this many local worker processes
+    const char* socket_path = nullptr;// where the coordinator listens for workers
+    const char* join_socket = nullptr;// run as a worker of the coordinator listening here
+    const char* serve_socket = nullptr;// keep scenes loaded and render requests sent to this socket
+    const char* tile_file = nullptr;// stream finished tiles to this file or fifo
+    const char* tile_ring = nullptr;// stream finished tiles into this shared memory ring
+    int crop[4] = { 0, 0, 0, 0 };// x0, y0, x1, y1 pixels of the frame to render, all of it when empty
+    int view_count = 0;// render this many views orbiting the scene's camera target in one batch
+
+    void apply(camera& cam) const {
+        if (samples_per_pixel > 0) cam.samples_per_pixel = samples_per_pixel;
+        if (image_width > 0) cam.image_width = image_width;
+        if (image_height > 0) cam.aspect_ratio = double(cam.image_width) / image_height;
+        cam.thread_count = thread_count > 0 ? thread_count : 1;
+        cam.seed = seed;
+        if (profile && output_file != nullptr)
+            cam.profile_prefix = output_stem();
+        if (aovs && output_file != nullptr)
+            cam.aov_prefix = output_stem();
+        cam.denoise = denoise;
+        cam.wavefront = wavefront;
+        cam.pass_samples = pass_samples;
+        cam.checkpoint_seconds = checkpoint_seconds;
+        cam.time_budget = time_budget;
+        cam.crop_x0 = crop[0];
+        cam.crop_y0 = crop[1];
+        cam.crop_x1 = crop[2];
+        cam.crop_y1 = crop[3];
+        cam.snapshot_file = output_file != nullptr ? output_stem() + "_snapshot.ppm" : "snapshot.ppm";
+    }
 
-    cam.render(world);
+    // extra images are named from the output file, outputs/image.ppm gives outputs/image_time.pfm and so on
+    std::string output_stem() const {
+        std::string stem = output_file;
+        auto extension = stem.rfind('.');
+        if (extension != std::string::npos && stem.find_first_of("/\\", extension) == std::string::npos)
+            stem.erase(extension);
+        return stem;
+    }
+};
+
+void print_usage() {
+    std::cerr << "Usage: raytracing [options] > image.ppm\n"
+                 "  --scene <file>     scene description to render (default scenes/cornell_box.scene)\n"
+                 "  --spp <n>          samples per pixel\n"
+                 "  --width <n>        image width in pixels\n"
+                 "  --height <n>       image height in pixels, sets the aspect ratio with the width\n"
+                 "  --threads <n>      render threads (default all hardware threads)\n"
+                 "  --seed <n>         base random seed\n"
+                 "  --out <file>       write the image to a file instead of stdout\n"
+                 "  --crop <x0,y0,x1,y1> only render pixels x0 <= x < x1 and y0 <= y < y1 of the frame\n"
+                 "  --profile          also write the time, samples and bounce depth of each pixel next to the --out image\n"
+                 "  --aovs             also write the first hit albedo, normal, depth and object id next to the --out image\n"
+                 "  --denoise          filter the image with the edge aware denoiser before writing it\n"
+                 "  --wavefront        trace each tile's samples together a bounce at a time, grouping hits by material\n"
+                 "  --memory           print the memory taken by the scene and the render's buffers, after loading and rendering\n"
+                 "  --memory-budget <MiB> trace from the scene cache if the render would take more, refuse if it still would\n"
+                 "  --passes <n>       render progressively in passes of n samples per pixel\n"
+                 "  --checkpoint <file> save progressive renders to file between passes and resume from it\n"
+                 "  --checkpoint-every <s> seconds between checkpoints (default 60)\n"
+                 "  --budget <s>       keep refining the image in passes until s seconds have passed, instead of --spp\n"
+                 "  --workers <n>      split the passes across n worker processes, more can join while it renders,\n"
+                 "                     without --passes the passes are spp/16 samples each\n"
+                 "  --socket <path>    socket the --workers coordinator listens on (default /tmp/raytracing_<pid>.sock)\n"
+                 "  --join <path>      render passes for the coordinator listening on path\n"
+                 "  --serve <path>     keep scenes loaded and render requests sent to the socket at path\n"
+                 "  --tiles <file>     stream each finished tile to file (a fifo works) as it's rendered\n"
+                 "  --tile-ring <name> stream each finished tile into the named shared memory ring\n"
+                 "  --views <n>        render n views circling the camera target together, to <out>_view_000.ppm and so on\n"
+                 "  --cache <dir>      trace from a memory mapped scene cache in dir\n"
+                 "  --texture-cache <dir> page image textures in by tiles, keeping tiled copies in dir\n"
+                 "  --texture-memory <MiB> memory kept for texture tiles (default 256)\n"
+                 "  --animate <n>      render n frames of the animated cornell box to outputs/\n";
 }
 
-void bouncing_spheres() {
-    hittable_list world;
-    auto checker = make_shared<checker_texture>(0.32, colour(.2, .3, .1), colour(.9, .9, .9));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = colour::random() * colour::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    auto center2 = center + vec3(0, random_double(0,.5), 0);
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = colour::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
+bool parse_options(int argc, char* argv[], render_options& options) {
+    for (int i = 1; i < argc; i++) {
+        auto option = argv[i];
+        if (std::strcmp(option, "--help") == 0)
+            return false;
+        if (std::strcmp(option, "--profile") == 0) { options.profile = true; continue; }
+        if (std::strcmp(option, "--aovs") == 0)    { options.aovs = true; continue; }
+        if (std::strcmp(option, "--denoise") == 0) { options.denoise = true; continue; }
+        if (std::strcmp(option, "--wavefront") == 0) { options.wavefront = true; continue; }
+        if (std::strcmp(option, "--memory") == 0)  { options.memory = true; continue; }
+        if (i + 1 >= argc) {
+            std::cerr << "ERROR: Missing value for '" << option << "'.\n";
+            return false;
+        }
+        auto value = argv[++i];
+        if (std::strcmp(option, "--scene") == 0)        options.scene_file = value;
+        else if (std::strcmp(option, "--spp") == 0)     options.samples_per_pixel = std::atoi(value);
+        else if (std::strcmp(option, "--width") == 0)   options.image_width = std::atoi(value);
+        else if (std::strcmp(option, "--height") == 0)  options.image_height = std::atoi(value);
+        else if (std::strcmp(option, "--threads") == 0) options.thread_count = std::atoi(value);
+        else if (std::strcmp(option, "--seed") == 0)    options.seed = unsigned(std::strtoul(value, nullptr, 10));
+        else if (std::strcmp(option, "--out") == 0)     options.output_file = value;
+        else if (std::strcmp(option, "--passes") == 0)  options.pass_samples = std::atoi(value);
+        else if (std::strcmp(option, "--checkpoint") == 0) options.checkpoint_file = value;
+        else if (std::strcmp(option, "--checkpoint-every") == 0) options.checkpoint_seconds = std::atof(value);
+        else if (std::strcmp(option, "--budget") == 0)  options.time_budget = std::atof(value);
+        else if (std::strcmp(option, "--workers") == 0) options.worker_count = std::atoi(value);
+        else if (std::strcmp(option, "--socket") == 0)  options.socket_path = value;
+        else if (std::strcmp(option, "--join") == 0)    options.join_socket = value;
+        else if (std::strcmp(option, "--serve") == 0)   options.serve_socket = value;
+        else if (std::strcmp(option, "--crop") == 0) {
+            if (std::sscanf(value, "%d,%d,%d,%d", &options.crop[0], &options.crop[1], &options.crop[2], &options.crop[3]) != 4) {
+                std::cerr << "ERROR: --crop takes x0,y0,x1,y1.\n";
+                return false;
             }
         }
+        else if (std::strcmp(option, "--tiles") == 0)   options.tile_file = value;
+        else if (std::strcmp(option, "--tile-ring") == 0) options.tile_ring = value;
+        else if (std::strcmp(option, "--views") == 0)   options.view_count = std::atoi(value);
+        else if (std::strcmp(option, "--cache") == 0)   options.cache_dir = value;
+        else if (std::strcmp(option, "--texture-cache") == 0) options.texture_cache_dir = value;
+        else if (std::strcmp(option, "--texture-memory") == 0) options.texture_memory = std::atof(value);
+        else if (std::strcmp(option, "--memory-budget") == 0) options.memory_budget = std::atof(value);
+        else if (std::strcmp(option, "--animate") == 0) options.animate_frames = std::atoi(value);
+        else {
+            std::cerr << "ERROR: Unknown option '" << option << "'.\n";
+            return false;
+        }
     }
-
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(colour(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    world = hittable_list(make_shared<bvh_node>(world));
-
-    camera cam;
-
-    cam.aspect_ratio      = 16.0 / 9.0;
-    cam.image_width       = 1200;
-    cam.samples_per_pixel = 100;
-    cam.max_depth         = 50;
-
-    cam.fov = 90;
-    cam.cam_center = point3(13,2,3);
-    cam.look_point = point3(0,0,0);
-    cam.vup = vec3(0,1,0);
-
-    cam.defocus_angle = 0.6;
-    cam.focus_dist    = 10.0;
-    cam.background_colour = colour(.7, .8, 1.0);
-    //render the world 
-    cam.render(world);
+    if (options.checkpoint_file != nullptr && options.pass_samples <= 0 && options.time_budget <= 0) {
+        std::cerr << "ERROR: --checkpoint needs --passes or --budget.\n";
+        return false;
+    }
+    bool single_process_only = options.profile || options.aovs || options.denoise || options.checkpoint_file != nullptr
+                            || options.time_budget > 0 || options.cache_dir != nullptr || options.memory_budget > 0;
+    if (options.worker_count >= 0 && single_process_only) {
+        std::cerr << "ERROR: --workers can't be combined with --profile, --aovs, --denoise, --checkpoint, --budget, --cache or --memory-budget.\n";
+        return false;
+    }
+    if ((options.profile || options.aovs) && options.output_file == nullptr) {
+        std::cerr << "ERROR: --profile and --aovs need an --out image to write next to.\n";
+        return false;
+    }
+    if (options.view_count > 0 && (options.output_file == nullptr || options.worker_count >= 0 || options.checkpoint_file != nullptr
+                                   || options.time_budget > 0 || options.tile_file != nullptr || options.tile_ring != nullptr)) {
+        std::cerr << "ERROR: --views needs --out and can't be combined with --workers, --checkpoint, --budget, --tiles or --tile-ring.\n";
+        return false;
+    }
+    return true;
 }
 
-void checkered_spheres() {
-    hittable_list world;
-
-    auto checker = make_shared<checker_texture>(0.32, colour(.2, .3, .1), colour(.9, .9, .9));
-
-    world.add(make_shared<sphere>(point3(0,-10, 0), 10, make_shared<lambertian>(checker)));
-    world.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
-
-    camera cam;
-
-    cam.aspect_ratio      = 16.0 / 9.0;
-    cam.image_width       = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth         = 50;
-
-    cam.fov     = 20;
-    cam.cam_center = point3(13,2,3);
-    cam.look_point   = point3(0,0,0);
-    cam.vup      = vec3(0,1,0);
-
-    cam.defocus_angle = 0;
-    cam.background_colour = colour(.7, .8, 1.0);
-
-    cam.render(world);
+// Coordinates the passes of the scene across worker processes, see distributed.h
+bool render_distributed(const render_options& options, const camera& cam) {
+    char scene_path[PATH_MAX];
+    if (realpath(options.scene_file, scene_path) == nullptr) {
+        std::cerr << "ERROR: Could not find scene file '" << options.scene_file << "'.\n";
+        return false;
+    }
+    render_job job;
+    job.scene_file = scene_path;
+    job.image_width = cam.image_width;
+    job.aspect_ratio = cam.aspect_ratio;
+    job.samples_per_pixel = cam.samples_per_pixel;
+    // split into passes even when none were asked for, so there is work for more than one worker
+    job.pass_samples = cam.pass_samples > 0 ? cam.pass_samples : std::max(1, cam.samples_per_pixel / 16);
+    job.seed = cam.seed;
+    job.crop[0] = cam.crop_x0;
+    job.crop[1] = cam.crop_y0;
+    job.crop[2] = cam.crop_x1;
+    job.crop[3] = cam.crop_y1;
+    job.wavefront = cam.wavefront;
+
+    std::string socket_path = options.socket_path != nullptr ? options.socket_path
+                            : "/tmp/raytracing_" + std::to_string(getpid()) + ".sock";
+    int local_threads = std::max(1, options.thread_count / std::max(1, options.worker_count));
+
+    render_coordinator coordinator;
+    if (options.output_file == nullptr)
+        return coordinator.render(job, socket_path, options.worker_count, local_threads, std::cout);
+    std::ofstream out(options.output_file);
+    if (!out) {
+        std::cerr << "ERROR: Could not open output file '" << options.output_file << "'.\n";
+        return false;
+    }
+    return coordinator.render(job, socket_path, options.worker_count, local_threads, out);
 }
 
-void earth() {
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0,0,0), 2, earth_surface);
-
-    camera cam;
-
-    cam.aspect_ratio      = 16.0 / 9.0;
-    cam.image_width       = 400;
-    cam.samples_per_pixel = 3;
-    cam.max_depth         = 10;
-
-    cam.fov     = 20;
-    cam.cam_center = point3(0,0,12);
-    cam.look_point   = point3(0,0,0);
-    cam.vup      = vec3(0,1,0);
-
-    cam.defocus_angle = 0;
-    cam.background_colour = colour(.7, .8, 1.0);
+// Renders the scene from view_count cameras spaced evenly around the scene camera's target,
+// sharing the scene and the render threads between all of them
+bool render_views(const render_options& options, const scene& loaded, const hittable& world) {
+    std::vector<camera> views(options.view_count, loaded.cam);
+    std::vector<camera*> batch;
+    vec3 offset = loaded.cam.cam_center - loaded.cam.look_point;
+    vec3 axis = unit_vector(loaded.cam.vup);
+    for (int i = 0; i < options.view_count; i++) {
+        // rotate the offset about the up axis (Rodrigues' formula)
+        double angle = 2*PI * i / options.view_count;
+        vec3 rotated = std::cos(angle)*offset + std::sin(angle)*cross(axis, offset)
+                     + (1 - std::cos(angle))*dot(axis, offset)*axis;
+        views[i].cam_center = loaded.cam.look_point + rotated;
+        std::ostringstream stem;
+        stem << options.output_stem() << "_view_" << std::setfill('0') << std::setw(3) << i;
+        if (!views[i].profile_prefix.empty())
+            views[i].profile_prefix = stem.str();
+        if (!views[i].aov_prefix.empty())
+            views[i].aov_prefix = stem.str();
+        batch.push_back(&views[i]);
+    }
 
-    cam.render(hittable_list(globe));
+    auto images = camera::render_batch(batch, world, loaded.lights);
+    for (int i = 0; i < options.view_count; i++) {
+        std::ostringstream filename;
+        filename << options.output_stem() << "_view_" << std::setfill('0') << std::setw(3) << i << ".ppm";
+        std::ofstream out(filename.str());
+        if (!out) {
+            std::cerr << "ERROR: Could not open output file '" << filename.str() << "'.\n";
+            return false;
+        }
+        views[i].write_image(out, images[i]);
+    }
+    if (loaded.cam.show_progress)
+        std::clog << "\rDone.                 \n";
+    return true;
 }
-void perlin_spheres() {
-    hittable_list world;
-
-    auto pertext = make_shared<noise_texture>(4);
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
-    world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
-
-    camera cam;
-
-    cam.aspect_ratio      = 16.0 / 9.0;
-    cam.image_width       = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth         = 50;
-
-    cam.fov     = 20;
-    cam.cam_center = point3(13,2,3);
-    cam.look_point   = point3(0,0,0);
-    cam.vup      = vec3(0,1,0);
 
-    cam.defocus_angle = 0;
-    cam.background_colour = colour(.7, .8, 1.0);
-
-    cam.render(world);
+// Memory the loaded scene, traced from world, and its render take
+memory_usage measure_memory(const render_options& options, const scene& loaded, const hittable& world) {
+    memory_usage usage;
+    loaded.world.measure(usage);
+    if (&world != &loaded.world)
+        world.measure(usage);
+    loaded.lights.measure(usage);
+    loaded.store.measure(usage);
+    usage.textures += texture_cache::global().resident();
+    usage.framebuffers = loaded.cam.framebuffer_bytes() * std::max(1, options.view_count);
+    return usage;
 }
 
-void simple_light() {
-    hittable_list world;
-
-    auto pertext = make_shared<noise_texture>(4);//perlin noise texture
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
-    world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
-
-    auto difflight = make_shared<diffuse_light>(colour(4,4,4));//diffuse light material
-    world.add(make_shared<sphere>(point3(0,7,0), 2, difflight));
-    world.add(make_shared<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
-
-    camera cam;
-
-    cam.aspect_ratio      = 16.0 / 9.0;
-    cam.image_width       = 400;
-    cam.samples_per_pixel = 100;
-    cam.max_depth         = 50;
-    cam.background_colour = colour(0,0,0);
+// Keeps the render under the memory budget by tracing from the scene cache, which takes the place
+// of the BVH and the lists over the primitives. Returns false if it can't get under the budget.
+bool fit_memory_budget(const render_options& options, scene& loaded, uint64_t cache_key, const hittable*& world,
+                       shared_ptr<hittable>& cached_world) {
+    auto budget = size_t(options.memory_budget * 1024 * 1024);
+    auto usage = measure_memory(options, loaded, *world);
+    if (usage.total() <= budget)
+        return true;
+
+    if (cached_world == nullptr) {
+        auto directory = options.cache_dir != nullptr ? std::string(options.cache_dir)
+                                                      : std::filesystem::temp_directory_path().string();
+        cached_world = find_scene_cache(directory, cache_key);
+        if (cached_world == nullptr)
+            cached_world = build_scene_cache(loaded.world, directory, cache_key);
+    }
+    if (cached_world != nullptr && !loaded.world.hittable_objects.empty()) {
+        std::clog << "Over the memory budget, tracing from the scene cache\n";
+        world = cached_world.get();
+        loaded.world.clear();
+        loaded.world.hittable_objects.shrink_to_fit();
+        usage = measure_memory(options, loaded, *world);
+    }
+    if (usage.total() > budget) {
+        std::cerr << "ERROR: The render needs " << std::fixed << std::setprecision(1) << usage.total() / 1048576.0
+                  << " MiB, over the memory budget of " << std::defaultfloat << options.memory_budget << " MiB.\n";
+        return false;
+    }
+    return true;
+}
 
-    cam.fov     = 20;
-    cam.cam_center = point3(26,3,6);
-    cam.look_point   = point3(0,2,0);
-    cam.vup      = vec3(0,1,0);
+bool render_scene(const render_options& options) {
+    std::string source;
+    if (!scene_loader::read(options.scene_file, source))
+        return false;
+    auto cache_key = scene_cache_key(source);
+    shared_ptr<hittable> cached_world;
+    if (options.cache_dir != nullptr)// with a cache built from the same scene file the world isn't built at all
+        cached_world = find_scene_cache(options.cache_dir, cache_key);
+
+    scene loaded;
+    scene_loader loader;
+    if (!loader.parse(source, options.scene_file, loaded, cached_world == nullptr))
+        return false;
+    options.apply(loaded.cam);
+    loaded.cam.scene_hash = fnv1a(source.data(), source.size());
+    if (options.memory)
+        loaded.store.report(std::clog);
+    if (options.checkpoint_file != nullptr)
+        loaded.cam.checkpoint_file = options.checkpoint_file;
+    if (options.worker_count >= 0)
+        return render_distributed(options, loaded.cam);
+
+    std::ofstream tiles;
+    shared_tile_ring ring;
+    if (options.tile_file != nullptr) {
+        tiles.open(options.tile_file, std::ios::binary);
+        if (!tiles) {
+            std::cerr << "ERROR: Could not open tile output '" << options.tile_file << "'.\n";
+            return false;
+        }
+        loaded.cam.on_tile = tile_stream_writer(tiles);
+    } else if (options.tile_ring != nullptr) {
+        if (!ring.create(options.tile_ring, 64, camera::tile_size * camera::tile_size))
+            return false;
+        loaded.cam.on_tile = ring.writer();
+    }
 
-    cam.defocus_angle = 0;
+    const hittable* world = &loaded.world;
+    if (options.cache_dir != nullptr && cached_world == nullptr) {// first run, build the cache and drop the world
+        cached_world = build_scene_cache(loaded.world, options.cache_dir, cache_key);
+        if (cached_world != nullptr) {
+            loaded.world.clear();
+            loaded.world.hittable_objects.shrink_to_fit();
+        }
+    }
+    if (cached_world != nullptr)
+        world = cached_world.get();
+    if (options.memory_budget > 0 && !fit_memory_budget(options, loaded, cache_key, world, cached_world))
+        return false;
+    if (options.memory) {
+        measure_memory(options, loaded, *world).print(std::clog, "after loading");
+        loaded.cam.on_pass = [&](int passes) {// texture tiles paged in so far show up as the render goes on
+            std::ostringstream stage;
+            stage << "after pass " << passes;
+            if (loaded.cam.show_progress)
+                std::clog << '\n';// past the progress line
+            measure_memory(options, loaded, *world).print(std::clog, stage.str().c_str());
+        };
+    }
 
-    cam.render(world);
+    bool rendered = true;
+    if (options.view_count > 0) {
+        rendered = render_views(options, loaded, *world);
+    } else if (options.output_file == nullptr) {
+        loaded.cam.render(*world, loaded.lights);
+    } else {
+        std::ofstream out(options.output_file);
+        if (!out) {
+            std::cerr << "ERROR: Could not open output file '" << options.output_file << "'.\n";
+            return false;
+        }
+        loaded.cam.render(*world, loaded.lights, out);
+    }
+    if (options.memory)
+        measure_memory(options, loaded, *world).print(std::clog, "after rendering");
+    return rendered;
 }
-*/
-void cornell_box() {
+
+void cornell_box_animation(int frame_count, const render_options& options) {
+    // Renders the cornell box with the box spinning and sliding across the floor, the bvh is
+    // built once and refit each frame since only the transforms change between frames
     hittable_list world;
 
     auto red   = make_shared<lambertian>(colour(.65, .05, .05));
@@ -229,16 +407,17 @@ void cornell_box() {
     // Light
     world.add(make_shared<quad>(point3(213,554,227), vec3(130,0,0), vec3(0,0,105), light));
 
-    // Box
-    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
-    world.add(box1);
+    // Animated box, the transforms are kept to be updated each frame
+    auto box_rotation = make_shared<rotate_y>(box(point3(0,0,0), point3(165,330,165), white), 15);
+    auto box_translation = make_shared<translate>(box_rotation, vec3(265,0,295));
+    world.add(box_translation);
 
     // Glass Sphere
     auto glass = make_shared<dielectric>(1.5);
     world.add(make_shared<sphere>(point3(190,90,190), 90, glass));
 
+    auto bvh = make_shared<bvh_node>(world);
+
     // Light Sources
     auto empty_material = shared_ptr<material>();
     hittable_list lights;
@@ -259,27 +438,57 @@ void cornell_box() {
     cam.vup      = vec3(0, 1, 0);
 
     cam.defocus_angle = 0;
-
-    cam.render(world, lights);
+    options.apply(cam);
+
+    for (int frame = 0; frame < frame_count; frame++) {
+        auto progress = double(frame) / frame_count;
+        box_rotation->set_angle(15 + 360*progress);
+        box_translation->set_offset(vec3(265, 0, 295 - 150*progress));
+        bvh->refit();// only the bounds change, so refit rather than rebuild
+
+        std::ostringstream filename;
+        filename << "outputs/frame_" << std::setfill('0') << std::setw(3) << frame << ".ppm";
+        std::ofstream out(filename.str());
+        cam.render(*bvh, lights, out);
+    }
 }
 
+int main(int argc, char* argv[]) {
+    render_options options;
+    if (!parse_options(argc, argv, options)) {
+        print_usage();
+        return 1;
+    }
+
+    if (options.texture_cache_dir != nullptr) {
+        auto& textures = texture_cache::global();
+        textures.directory = options.texture_cache_dir;
+        textures.memory_budget = size_t(std::max(0.0, options.texture_memory) * 1024 * 1024);
+    }
+
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, [](int) { camera::request_snapshot(); });// kill -USR1 writes the progressive image so far
+#endif
 
-#include <iomanip>
-int main() {
     auto start = std::chrono::high_resolution_clock::now();
-    /*switch (7) {
-        case 1:  bouncing_spheres();  break;
-        case 2:  checkered_spheres(); break;
-        case 3:  earth();             break;
-        case 4:  perlin_spheres();    break;
-        case 5:  quads();             break;
-        case 6:  simple_light();      break;
-        case 7:  cornell_box();       break;
-        case 8:  cornell_smoke();     break;
-    }*/
-    cornell_box();
+    if (options.serve_socket != nullptr) {
+        render_server server;
+        server.thread_count = options.thread_count > 0 ? options.thread_count : 1;
+        if (!server.serve(options.serve_socket))
+            return 1;
+    } else if (options.join_socket != nullptr) {
+        if (!run_render_worker(options.join_socket, options.thread_count))
+            return 1;
+    } else if (options.animate_frames > 0) {
+        cornell_box_animation(options.animate_frames, options);
+    } else if (!render_scene(options)) {
+        return 1;
+    }
     auto stop = std::chrono::high_resolution_clock::now();
     float duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count()/1000000.f;
     
     std::clog << "Time taken: "<< std::fixed << std::setprecision(3) <<duration << "s\n";
-}
\ No newline at end of file
+    if (texture_cache::global().enabled())
+        std::clog << "Texture tiles read: " << texture_cache::global().tiles_read()
+                  << ", evicted: " << texture_cache::global().tiles_evicted() << "\n";
+}
@@ -4,6 +4,7 @@
 #include "headers.h"
 #include "pdf.h"
 #include "texture.h"
+#include "flat_scene.h"
 
 class hit_record;
 
@@ -29,19 +30,55 @@ class material {
                          scatter_record& scatter_rec) const {
         return false;
     }
+
+    // The texture scatter attenuates by, null if it doesn't use one. Callers shading many hits of
+    // the material together can look all of them up in one batch and pass each to scatter_with_albedo
+    virtual const texture_program* albedo_program() const {
+        return nullptr;
+    }
+
+    // scatter with the value of albedo_program at the hit already looked up
+    virtual bool scatter_with_albedo(const ray& r_in, const hit_record& rec, const colour& albedo,
+                                     scatter_record& scatter_rec) const {
+        return scatter(r_in, rec, scatter_rec);
+    }
     virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
       return 0;
     }
+
+    // true for the phase functions media scatter by, the camera lights their scattering points
+    // straight from the lights through the media in between
+    virtual bool is_phase_function() const {
+      return false;
+    }
+
+    // write the material as a plain record, returns false if it can't be flattened
+    virtual bool flatten(flat_material& record) const {
+      return false;
+    }
 };
 
+inline void store_colour(flat_material& record, const colour& c) {
+    record.params[0] = c.x();
+    record.params[1] = c.y();
+    record.params[2] = c.z();
+}
+
 class lambertian : public material {
   public:
-    lambertian(const colour& albedo) : m_texture(make_shared<solid_color>(albedo)) {}
-    lambertian(shared_ptr<texture> tex) : m_texture(tex) {}
+    lambertian(const colour& albedo) : lambertian(make_shared<solid_color>(albedo)) {}
+    lambertian(shared_ptr<texture> tex) : m_texture(tex), m_program(*tex) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, scatter_record& scatter_rec)
     const override {
-		scatter_rec.attenuation = m_texture->value(rec.u, rec.v, rec.p);
+        return scatter_with_albedo(r_in, rec, m_program.value(rec.u, rec.v, rec.p, rec.uv_footprint), scatter_rec);
+    }
+
+    const texture_program* albedo_program() const override { return &m_program; }
+
+    bool scatter_with_albedo(const ray& r_in, const hit_record& rec, const colour& albedo, scatter_record& scatter_rec)
+    const override {
+		scatter_rec.attenuation = albedo;
         scatter_rec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
 		scatter_rec.skip_pdf = false;
         return true;
@@ -51,8 +88,18 @@ class lambertian : public material {
       	auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
 		return cos_theta < 0 ? 0 : cos_theta / PI;
     }
+
+    bool flatten(flat_material& record) const override {
+        // only constant colours can be flattened
+        if (std::dynamic_pointer_cast<solid_color>(m_texture) == nullptr)
+            return false;
+        record.type = FLAT_LAMBERTIAN;
+        store_colour(record, m_texture->value(0, 0, point3()));
+        return true;
+    }
   private:
     shared_ptr<texture> m_texture;
+    texture_program m_program;// m_texture compiled
 };
 class metal : public material {
   public:
@@ -70,6 +117,13 @@ class metal : public material {
         return true;
     }
 
+    bool flatten(flat_material& record) const override {
+        record.type = FLAT_METAL;
+        store_colour(record, m_albedo);
+        record.params[3] = m_fuzz;
+        return true;
+    }
+
   private:
     colour m_albedo;
     double m_fuzz;//fuzz varies the reflected ray angle randomly, creating less sharp reflections
@@ -102,6 +156,12 @@ class dielectric : public material {
         return true;
     }
 
+    bool flatten(flat_material& record) const override {
+        record.type = FLAT_DIELECTRIC;
+        record.params[3] = m_refraction_index;
+        return true;
+    }
+
   private:
     double m_refraction_index;// ratio of the material's refractive index over the refractive index of the enclosing media
 
@@ -115,31 +175,47 @@ class dielectric : public material {
 class diffuse_light : public material {
   public:
     // constructor to emit light using a texture
-    diffuse_light(shared_ptr<texture> tex) : texture(tex){}
+    diffuse_light(shared_ptr<::texture> tex) : texture(tex), program(*tex) {}
 
     // constructor to emit light with a single colour
-    diffuse_light(const colour& emit_color) : texture(make_shared<solid_color>(emit_color)) {}
+    diffuse_light(const colour& emit_color) : diffuse_light(make_shared<solid_color>(emit_color)) {}
 
     colour emitted(const ray& r_in, const hit_record& rec, double u, double v, const point3& pos)
 	const override {
 		if(!rec.front_face){
 			return colour(0,0,0);//emission only on surface faces
 		}
-        return texture->value(u,v,pos);
+        return program.value(u,v,pos,rec.uv_footprint);
+    }
+
+    bool flatten(flat_material& record) const override {
+        if (std::dynamic_pointer_cast<solid_color>(texture) == nullptr)
+            return false;
+        record.type = FLAT_DIFFUSE_LIGHT;
+        store_colour(record, texture->value(0, 0, point3()));
+        return true;
     }
 
   private:
-    shared_ptr<texture> texture;
+    shared_ptr<::texture> texture;
+    texture_program program;// texture compiled
 };
 
 class isotropic : public material {
   public:
-	isotropic(const colour& albedo) : tex(make_shared<solid_color>(albedo)) {}
-	isotropic(shared_ptr<texture> tex) : tex(tex) {}
+	isotropic(const colour& albedo) : isotropic(make_shared<solid_color>(albedo)) {}
+	isotropic(shared_ptr<texture> tex) : tex(tex), program(*tex) {}
   
 	bool scatter(const ray& r_in, const hit_record& rec, scatter_record& scatter_rec)
 	const override {
-		scatter_rec.attenuation = tex->value(rec.u, rec.v, rec.p);
+		return scatter_with_albedo(r_in, rec, program.value(rec.u, rec.v, rec.p, rec.uv_footprint), scatter_rec);
+	}
+
+	const texture_program* albedo_program() const override { return &program; }
+
+	bool scatter_with_albedo(const ray& r_in, const hit_record& rec, const colour& albedo, scatter_record& scatter_rec)
+	const override {
+		scatter_rec.attenuation = albedo;
         scatter_rec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
 		scatter_rec.skip_pdf = false;
         return true;
@@ -149,8 +225,11 @@ class isotropic : public material {
 	const override{
 		return 1 / (4 * PI);
 	}
+
+	bool is_phase_function() const override { return true; }
   private:
 	shared_ptr<texture> tex;
+	texture_program program;// tex compiled
 };
   
 
@@ -0,0 +1,56 @@
+#ifndef MEMORY_USAGE_H
+#define MEMORY_USAGE_H
+
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <unordered_set>
+
+// Bytes a scene and its render take, by subsystem. The world is walked with hittable::measure,
+// which counts each object the first time it is reached so instances sharing geometry aren't
+// counted twice. The figures are what the objects allocated, not what the allocator reserved.
+
+struct memory_usage {
+    // bytes of the control block make_shared or allocate_shared puts in front of an object: its
+    // vtable pointer and the strong and weak counts
+    static const size_t control_block_size = 16;
+
+    size_t geometry = 0;       // Primitives, transforms, volumes and the lists holding them
+    size_t acceleration = 0;   // BVH nodes
+    size_t materials = 0;
+    size_t textures = 0;       // Texture objects, their pixels and the texture cache's resident tiles
+    size_t framebuffers = 0;   // The camera's accumulation, output, aov and profile buffers
+    size_t control_blocks = 0; // Reference counts of the objects made with make_shared
+    size_t mapped = 0;         // Scene cache files mapped in, paged by the OS so not in total()
+
+    size_t total() const {
+        return geometry + acceleration + materials + textures + framebuffers + control_blocks;
+    }
+
+    // true the first time it is called for the object
+    bool first_visit(const void* object) {
+        return visited.insert(object).second;
+    }
+
+    void print(std::ostream& out, const char* stage) const {
+        out << "Memory " << stage << ":\n";
+        line(out, "geometry", geometry);
+        line(out, "bvh", acceleration);
+        line(out, "materials", materials);
+        line(out, "textures", textures);
+        line(out, "framebuffers", framebuffers);
+        line(out, "refcounts", control_blocks);
+        if (mapped > 0)
+            line(out, "mapped", mapped);
+        line(out, "total", total());
+    }
+
+  private:
+    std::unordered_set<const void*> visited;
+
+    static void line(std::ostream& out, const char* name, size_t bytes) {
+        out << "  " << std::left << std::setw(13) << name << std::right << std::setw(12) << bytes << " bytes\n";
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hittable_list.h"
 #include "onb.h"
+#include "stats.h"
 
 
 class pdf {
@@ -20,6 +21,7 @@ class uniform_sphere_pdf : public pdf {
         uniform_sphere_pdf(){};
     
     virtual double value(const vec3& direction) const override {
+        RT_STAT(pdf_evaluations);
         return 1 / (4*PI);
     }
     virtual vec3 generate() const override{
@@ -32,6 +34,7 @@ class cosine_pdf : public pdf {
         cosine_pdf(const vec3& w) : uvw(w) {}
   
         double value(const vec3& direction) const override {
+            RT_STAT(pdf_evaluations);
             auto cos_theta = dot(unit_vector(direction), uvw.w());
             return cos_theta < 0 ? 0 : cos_theta / PI;
         }
@@ -53,6 +56,7 @@ class hittable_pdf : public pdf {
             }
   
         double value(const vec3& direction) const override {
+            RT_STAT(pdf_evaluations);
             return objects.pdf_value(origin, direction);
         }
         
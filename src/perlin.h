@@ -6,44 +6,46 @@
 class perlin {
   public:
     perlin() {
-        randvec = new vec3[point_count];//array sized to the number of points in the noise texture
-        for (int i = 0; i < point_count; i++) {//assigns a random value [0, 1] to every point
-            randvec[i] = unit_vector(vec3::random(-1,1));
+        for (int i = 0; i < point_count; i++) {//assigns a random unit vector to every point
+            auto g = unit_vector(vec3::random(-1,1));
+            gradient[i][0] = g.x();
+            gradient[i][1] = g.y();
+            gradient[i][2] = g.z();
         }
 
-        perm_x = perlin_generate_perm();//generates permutations of sequence 0-255 for each axis
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
-    }
-
-    ~perlin() {
-        delete[] randvec;
-        delete[] perm_x;
-        delete[] perm_y;
-        delete[] perm_z;
+        for (int axis = 0; axis < 3; axis++)//generates permutations of sequence 0-255 for each axis
+            perlin_generate_perm(perm[axis]);
     }
 
     double noise(const point3& p) const {
-        auto u = p.x() - floor(p.x());
-        auto v = p.y() - floor(p.y());
-        auto w = p.z() - floor(p.z());//double difference from floored value
-    
-        auto i = int(floor(p.x()));
-        auto j = int(floor(p.y()));
-        auto k = int(floor(p.z()));
-        vec3 c[2][2][2];
+        int i = fast_floor(p.x()), j = fast_floor(p.y()), k = fast_floor(p.z());
+        auto u = p.x() - i;
+        auto v = p.y() - j;
+        auto w = p.z() - k;//double difference from floored value
 
+        // the permutation lookups and smoothed weights of each axis are found once rather than
+        // once per corner
+        auto uu = u*u*(3-2*u);//Hermite cubic, smooths Mach bands
+        auto vv = v*v*(3-2*v);
+        auto ww = w*w*(3-2*w);
+        double weight_x[2] = { 1-uu, uu }, weight_y[2] = { 1-vv, vv }, weight_z[2] = { 1-ww, ww };
+        int hash_x[2] = { perm[0][i & 255], perm[0][(i+1) & 255] };
+        int hash_y[2] = { perm[1][j & 255], perm[1][(j+1) & 255] };
+        int hash_z[2] = { perm[2][k & 255], perm[2][(k+1) & 255] };
+
+        // interpolate the noise at each corner of the cube with the floored difference, returns -1 to 1
+        auto accum = 0.0;
         for (int di=0; di < 2; di++)
             for (int dj=0; dj < 2; dj++)
-                for (int dk=0; dk < 2; dk++)
-                    c[di][dj][dk] = randvec[
-                        perm_x[(i+di) & 255] ^
-                        perm_y[(j+dj) & 255] ^
-                        perm_z[(k+dk) & 255]
-                    ];//calculate the noise at each corner of the cube
-
-        return perlin_interp(c, u, v, w);//interpolate the values with the floored difference
+                for (int dk=0; dk < 2; dk++) {
+                    const double* c = gradient[hash_x[di] ^ hash_y[dj] ^ hash_z[dk]];
+                    accum += weight_x[di] * weight_y[dj] * weight_z[dk]
+                           * (c[0]*(u-di) + c[1]*(v-dj) + c[2]*(w-dk));//dots the weight with the current corner
+                }
+
+        return accum;
     }
+
     double octave(const point3& p, int depth) const {
         auto accum = 0.0;
         auto temp_p = p;
@@ -58,23 +60,35 @@ class perlin {
         return fabs(accum);
     }
 
+    // octave noise at count points, a convenience loop over the single point version
+    void octave(const point3* points, double* out, int count, int depth) const {
+        for (int i = 0; i < count; i++)
+            out[i] = octave(points[i], depth);
+    }
+
   private:
     static const int point_count = 256;
-    vec3* randvec;
-    int* perm_x;
-    int* perm_y;
-    int* perm_z;
-
-    static int* perlin_generate_perm() {//perlin noise algorithm
-        auto p = new int[point_count];
+    // the tables are members rather than separate heap arrays, the three permutations sit next
+    // to each other and each gradient is three packed doubles
+    double gradient[point_count][3];
+    int perm[3][point_count];
+
+    static int fast_floor(double x) {
+        // floor() is a library call unless the target has SSE4.1
+#ifdef __SSE4_1__
+        return int(std::floor(x));
+#else
+        int i = int(x);
+        return x < i ? i - 1 : i;
+#endif
+    }
 
+    static void perlin_generate_perm(int* p) {//perlin noise algorithm
         for (int i = 0; i < point_count; i++)//initalise array to index as values
             p[i] = i;
 
         permute(p, point_count);
-
-        return p;
-    }//returns array size 256, of a random permutation of sequence 0-255
+    }//fills p with a random permutation of sequence 0-255
 
     static void permute(int* p, int n) {
         for (int i = n-1; i > 0; i--) {//walk backwards swapping the current with points up to the current
@@ -84,25 +98,6 @@ class perlin {
             p[target] = tmp;
         }
     }
-
-    static double perlin_interp(const vec3 c[2][2][2], double u, double v, double w) {//returns -1 to 1
-        auto uu = u*u*(3-2*u);//Hermite cubic, smooths Mach bands
-        auto vv = v*v*(3-2*v);
-        auto ww = w*w*(3-2*w);
-        auto accum = 0.0;
-
-        for (int i=0; i < 2; i++)
-            for (int j=0; j < 2; j++)
-                for (int k=0; k < 2; k++) {
-                    vec3 weight_v(u-i, v-j, w-k);
-                    accum += (i*uu + (1-i)*(1-uu))
-                           * (j*vv + (1-j)*(1-vv))
-                           * (k*ww + (1-k)*(1-ww))
-                           * dot(c[i][j][k], weight_v);//dots the weight with the current corner
-                }
-
-        return accum;
-    }
 };
 
 #endif
\ No newline at end of file
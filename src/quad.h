@@ -4,6 +4,7 @@
 #include "headers.h"
 
 #include "hittable.h"
+#include "stats.h"
 
 class quad : public hittable {
   public:
@@ -29,7 +30,21 @@ class quad : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    bool flatten(scene_writer& writer) const override {
+        writer.add_quad(flat_type(), Q, u, v, flat_inner(), mat.get());
+        return true;
+    }
+
+    void measure(memory_usage& usage) const override {
+        usage.geometry += sizeof(quad);
+    }
+
+    // record type and inner radius of the planar shape when flattened
+    virtual int32_t flat_type() const { return FLAT_QUAD; }
+    virtual double flat_inner() const { return 0; }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(quad_tests);
         
         auto denominator = dot(normal, r.direction());//demonimator of t = (D - n . P)/(n . d)
         //from n . v = D & R(t) = P + t * d
@@ -56,11 +71,29 @@ class quad : public hittable {
         // Ray hits the 2D shape; set the rest of the hit record and return true.
         rec.t = t;
         rec.p = intersection;
+        rec.uv_scale = 1 / std::sqrt(area);
         rec.mat = mat;
+        rec.object_id = object_id;
         rec.set_face_normal(r, normal);
 
         return true;
     }
+    bool surface_crossings(const ray& r, interval ray_t, std::vector<double>& crossings) const override {
+        RT_STAT(quad_tests);
+        auto denominator = dot(normal, r.direction());
+        if (fabs(denominator) < 1e-8)
+            return true;
+        auto t = (D - dot(normal, r.origin())) / denominator;
+        if (!ray_t.contains(t))
+            return true;
+
+        vec3 planar_hitpt_vector = r.at(t) - Q;
+        hit_record unused;// is_interior sets the uv
+        if (is_interior(dot(w, cross(planar_hitpt_vector, v)), dot(w, cross(u, planar_hitpt_vector)), unused))
+            crossings.push_back(t);
+        return true;
+    }
+
     virtual bool is_interior(double alpha, double beta, hit_record& rec) const {// given plane coords check if within the unit interval
         interval unit_interval = interval(0, 1);
         // Given the hit point in plane coordinates, return false if it is outside the
@@ -112,6 +145,8 @@ public:
         auto bbox_diagonal2 = aabb(Q + u, Q + v);//uses 2 points constructor 
         bbox = aabb(bbox_diagonal1, bbox_diagonal2);//combined diagonals contains the entire quad
     }
+    int32_t flat_type() const override { return FLAT_TRIANGLE; }
+
     bool is_interior(double alpha, double beta, hit_record& rec) const override {
         if(!(alpha > 0 && beta > 0 && alpha + beta < 1)){return false;}
 
@@ -134,6 +169,8 @@ class ellipse : public quad {
         bbox = aabb(bbox_diagonal1, bbox_diagonal2);//combined diagonals contains the entire quad
     }
 
+    int32_t flat_type() const override { return FLAT_ELLIPSE; }
+
     bool is_interior(double a, double b, hit_record& rec) const override {
         if ((a*a + b*b) > 1)
             return false;
@@ -159,6 +196,13 @@ class annulus : public quad {
         bbox = aabb(bbox_diagonal1, bbox_diagonal2);//combined diagonals contains the entire quad
     }
 
+    int32_t flat_type() const override { return FLAT_ANNULUS; }
+    double flat_inner() const override { return m_inner; }
+
+    void measure(memory_usage& usage) const override {
+        usage.geometry += sizeof(annulus);
+    }
+
     bool is_interior(double a, double b, hit_record& rec) const override {
         auto center_dist = sqrt(a*a + b*b);
         if ((center_dist < m_inner) || (center_dist > 1))
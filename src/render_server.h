@@ -0,0 +1,281 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include "headers.h"
+
+#include "camera.h"
+#include "distributed.h"
+#include "scene_loader.h"
+
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/time.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+// Long running render process that keeps every scene it has loaded in memory, along with its
+// decoded textures and BVHs, so repeat renders only pay for tracing. Clients connect to a unix
+// socket and send one request line, the server replies with the image as a .ppm or a line
+// starting with ERROR: and closes the connection. A request is a list of settings,
+//
+//     scene <file>              required, loaded on first use and again if the file changes
+//     spp <n>  width <n>  height <n>  seed <n>  depth <n>
+//     fov <degrees>  defocus <degrees>  focus <distance>
+//     from <x y z>  at <x y z>  up <x y z>
+//     crop <x0 y0 x1 y1>        only render and send back pixels x0 <= x < x1, y0 <= y < y1
+//
+// and the request "shutdown" stops the server. Requests longer than max_request_bytes, or that
+// don't arrive within client_timeout_seconds, are refused so one client can't hold up the others.
+
+#ifndef _WIN32
+
+class render_server {
+  public:
+    int thread_count = 1;       // Threads each render uses
+    bool show_progress = true;  // Log each request to the console
+
+    static const size_t max_request_bytes = 4096;
+    static const int client_timeout_seconds = 10;// for the request to arrive and for each write of the reply
+
+    // Serves requests until a shutdown request, returns false if the socket couldn't be opened
+    bool serve(const std::string& socket_path) {
+        sockaddr_un address;
+        if (!distributed::make_address(socket_path, address))
+            return false;
+        unlink(socket_path.c_str());
+        int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || listen(listen_fd, 16) != 0) {
+            std::cerr << "ERROR: Could not listen on '" << socket_path << "'.\n";
+            return false;
+        }
+        std::signal(SIGPIPE, SIG_IGN);// a client that hangs up shows up as a failed write
+        if (show_progress)
+            std::clog << "Serving renders on " << socket_path << "\n";
+
+        bool running = true;
+        while (running) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            timeval timeout = { client_timeout_seconds, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            running = handle(fd);
+            close(fd);
+        }
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        return true;
+    }
+
+  private:
+    struct resident_scene {
+        scene loaded;
+        long long modified;// file modification time it was loaded at
+    };
+
+    std::map<std::string, std::unique_ptr<resident_scene>> scenes;
+    resident_scene* loaded_scene = nullptr;// scene of the request being handled
+
+    struct request {
+        std::string scene_file;
+        long long seed = -1;// -1 keeps the scene's
+    };
+
+    // reads the request up to its newline, returns false if the client hangs up, times out or
+    // sends more than max_request_bytes first
+    static bool read_request(int fd, std::string& line) {
+        char buffer[512];
+        line.clear();
+        while (line.size() <= max_request_bytes) {
+            ssize_t received = ::read(fd, buffer, sizeof(buffer));
+            if (received <= 0)
+                return false;
+            line.append(buffer, size_t(received));
+            auto end = line.find('\n');
+            if (end != std::string::npos) {// anything after the first line is ignored
+                line.erase(end);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // returns false for a shutdown request
+    bool handle(int fd) {
+        std::string line;
+        if (!read_request(fd, line)) {
+            reply(fd, "ERROR: No request line within " + std::to_string(max_request_bytes) + " bytes and "
+                      + std::to_string(client_timeout_seconds) + " seconds.\n");
+            return true;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::istringstream words(line);
+        std::string first;
+        words >> first;
+        if (first == "shutdown") {
+            reply(fd, "OK\n");
+            return false;
+        }
+        words.clear();
+        words.seekg(0);
+
+        camera cam;
+        request settings;
+        std::string error;
+        if (!parse_request(words, settings, cam, error)) {
+            reply(fd, "ERROR: " + error + "\n");
+            return true;
+        }
+
+        std::ostringstream out;
+        cam.render(loaded_scene->loaded.world, loaded_scene->loaded.lights, out);
+        reply(fd, out.str());
+
+        if (show_progress)
+            std::clog << "Rendered " << settings.scene_file << " in "
+                      << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s\n";
+        return true;
+    }
+
+    bool parse_request(std::istringstream& words, request& settings, camera& cam, std::string& error) {
+        std::vector<std::pair<std::string, std::vector<double>>> overrides;
+        std::string key;
+        while (words >> key) {
+            if (key == "scene") {
+                if (!(words >> settings.scene_file)) {
+                    error = "Missing file after 'scene'.";
+                    return false;
+                }
+                continue;
+            }
+            if (key == "seed") {// read as an integer, converting an out of range double to unsigned is undefined
+                if (!(words >> settings.seed) || settings.seed < 0 || settings.seed > UINT_MAX
+                    || !(words.eof() || std::isspace(words.peek()))) {
+                    error = "Expected a whole number from 0 to " + std::to_string(UINT_MAX) + " after 'seed'.";
+                    return false;
+                }
+                continue;
+            }
+            int count = (key == "from" || key == "at" || key == "up") ? 3 : key == "crop" ? 4 : 1;
+            std::vector<double> values(count);
+            for (auto& value : values) {
+                if (!(words >> value)) {
+                    error = "Expected " + std::to_string(count) + " numbers after '" + key + "'.";
+                    return false;
+                }
+                if ((key == "spp" || key == "width" || key == "depth" || key == "crop") && !(std::fabs(value) <= INT_MAX)) {
+                    error = "'" + key + "' is out of range.";
+                    return false;
+                }
+            }
+            overrides.emplace_back(key, values);
+        }
+        if (settings.scene_file.empty()) {
+            error = "No scene given.";
+            return false;
+        }
+        loaded_scene = find_scene(settings.scene_file, error);
+        if (loaded_scene == nullptr)
+            return false;
+
+        cam = loaded_scene->loaded.cam;
+        cam.thread_count = thread_count;
+        cam.show_progress = false;
+        if (settings.seed >= 0)
+            cam.seed = unsigned(settings.seed);
+        double height = 0;
+        for (const auto& entry : overrides) {
+            const auto& k = entry.first;
+            const auto& v = entry.second;
+            if (k == "spp")            cam.samples_per_pixel = int(v[0]);
+            else if (k == "width")     cam.image_width = int(v[0]);
+            else if (k == "height")    height = v[0];
+            else if (k == "depth")     cam.max_depth = int(v[0]);
+            else if (k == "fov")       cam.fov = v[0];
+            else if (k == "defocus")   cam.defocus_angle = v[0];
+            else if (k == "focus")     cam.focus_dist = v[0];
+            else if (k == "from")      cam.cam_center = point3(v[0], v[1], v[2]);
+            else if (k == "at")        cam.look_point = point3(v[0], v[1], v[2]);
+            else if (k == "up")        cam.vup = vec3(v[0], v[1], v[2]);
+            else if (k == "crop") {
+                cam.crop_x0 = int(v[0]);
+                cam.crop_y0 = int(v[1]);
+                cam.crop_x1 = int(v[2]);
+                cam.crop_y1 = int(v[3]);
+            }
+            else {
+                error = "Unknown setting '" + k + "'.";
+                return false;
+            }
+        }
+        if (height > 0)// after the loop so it doesn't matter whether the width comes first
+            cam.aspect_ratio = double(cam.image_width) / height;
+        if (cam.image_width < 1 || cam.samples_per_pixel < 1 || cam.aspect_ratio <= 0) {
+            error = "Width, height and spp must be positive.";
+            return false;
+        }
+        return true;
+    }
+
+    // the resident copy of the scene, loading it if it's new or the file has changed since
+    resident_scene* find_scene(const std::string& filename, std::string& error) {
+        struct stat info;
+        if (stat(filename.c_str(), &info) != 0) {
+            error = "Could not find scene file '" + filename + "'.";
+            return nullptr;
+        }
+        long long modified = (long long)info.st_mtime;
+
+        auto& entry = scenes[filename];
+        if (entry != nullptr && entry->modified == modified)
+            return entry.get();
+
+        auto loaded = std::unique_ptr<resident_scene>(new resident_scene());
+        loaded->modified = modified;
+        scene_loader loader;
+        if (!loader.load(filename, loaded->loaded)) {
+            error = "Could not load scene file '" + filename + "'.";
+            scenes.erase(filename);
+            return nullptr;
+        }
+        if (show_progress)
+            std::clog << "Loaded " << filename << "\n";
+        entry = std::move(loaded);
+        return entry.get();
+    }
+
+    static void reply(int fd, const std::string& text) {
+        distributed::send_all(fd, text.data(), text.size());
+    }
+};
+
+#else
+
+class render_server {
+  public:
+    int thread_count = 1;
+    bool show_progress = true;
+
+    bool serve(const std::string&) {
+        std::cerr << "ERROR: The render server needs unix sockets.\n";
+        return false;
+    }
+};
+
+#endif
+
+#endif
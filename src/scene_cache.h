@@ -0,0 +1,489 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "headers.h"
+
+#include "aabb.h"
+#include "flat_scene.h"
+#include "hittable.h"
+#include "material.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+    #include <iterator>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Versioned binary cache of a flattened scene and its BVH. The file is laid out as a header
+// followed by the material, primitive and node arrays so it can be mapped into memory and traced
+// from directly without parsing or rebuilding anything. Caches are keyed by the text of the scene
+// file, so a hit is found before the world is built and an edited scene misses.
+
+const uint32_t scene_cache_version = 1;
+
+struct scene_cache_header {
+    char     magic[4];// "RTSC"
+    uint32_t version;
+    uint64_t source_hash;// scene_cache_key of the scene file the cache was built from
+    uint64_t material_count;
+    uint64_t primitive_count;
+    uint64_t node_count;
+    uint64_t material_offset;// byte offsets of each array from the start of the file
+    uint64_t primitive_offset;
+    uint64_t node_offset;
+};
+
+// Read only memory map of a whole file, falls back to reading the file into memory on windows
+class mapped_file {
+  public:
+    mapped_file() {}
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+#ifndef _WIN32
+        if (data != nullptr)
+            munmap(const_cast<unsigned char*>(data), size);
+#endif
+    }
+
+    bool open(const std::string& filename) {
+#ifdef _WIN32
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+            return false;
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data = reinterpret_cast<const unsigned char*>(buffer.data());
+        size = buffer.size();
+        return size > 0;
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            close(fd);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);// the mapping holds its own reference to the file
+        if (mapping == MAP_FAILED)
+            return false;
+
+        data = static_cast<const unsigned char*>(mapping);
+        size = info.st_size;
+        return true;
+#endif
+    }
+
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+
+  private:
+#ifdef _WIN32
+    std::vector<char> buffer;
+#endif
+};
+
+// Hittable that traces directly from the arrays of a mapped scene cache file
+class mapped_scene : public hittable {
+  public:
+    // Returns nullptr if the file is missing, truncated or from a different version or scene
+    static shared_ptr<mapped_scene> load(const std::string& filename, uint64_t key) {
+        auto scene = shared_ptr<mapped_scene>(new mapped_scene());
+        if (!scene->file.open(filename) || scene->file.size < sizeof(scene_cache_header))
+            return nullptr;
+
+        auto header = reinterpret_cast<const scene_cache_header*>(scene->file.data);
+        if (std::memcmp(header->magic, "RTSC", 4) != 0 || header->version != scene_cache_version
+            || header->source_hash != key || header->node_count == 0)
+            return nullptr;
+
+        if (!fits(header->material_offset, header->material_count, sizeof(flat_material), scene->file.size)
+            || !fits(header->primitive_offset, header->primitive_count, sizeof(flat_primitive), scene->file.size)
+            || !fits(header->node_offset, header->node_count, sizeof(flat_node), scene->file.size))
+            return nullptr;
+
+        scene->materials_data = reinterpret_cast<const flat_material*>(scene->file.data + header->material_offset);
+        scene->primitives = reinterpret_cast<const flat_primitive*>(scene->file.data + header->primitive_offset);
+        scene->nodes = reinterpret_cast<const flat_node*>(scene->file.data + header->node_offset);
+
+        if (!valid_indices(*scene, *header))
+            return nullptr;
+
+        // materials are tiny so they are the only thing turned back into objects
+        for (uint64_t i = 0; i < header->material_count; i++)
+            scene->materials.push_back(make_material(scene->materials_data[i]));
+
+        const double* b = scene->nodes[0].bounds;
+        scene->bbox = aabb(interval(b[0], b[1]), interval(b[2], b[3]), interval(b[4], b[5]));
+        return scene;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        int32_t stack[max_depth];// load has checked the tree isn't deeper
+        int stack_size = 0;
+        int32_t node_index = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const flat_node& node = nodes[node_index];
+            RT_STAT(bvh_nodes_visited);
+            if (node_bounds(node).hit(r, ray_t)) {
+                if (node.count > 0) {
+                    for (int32_t i = node.first; i < node.first + node.count; i++) {
+                        if (hit_primitive(primitives[i], r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;//only allow closer hits from here
+                        }
+                    }
+                } else {
+                    stack[stack_size++] = node.first;
+                    node_index = node_index + 1;
+                    continue;
+                }
+            }
+            if (stack_size == 0)
+                break;
+            node_index = stack[--stack_size];
+        }
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void measure(memory_usage& usage) const override {
+        usage.acceleration += sizeof(mapped_scene) + materials.capacity() * sizeof(shared_ptr<material>);
+#ifdef _WIN32
+        usage.acceleration += file.size;// read into memory rather than mapped
+#else
+        usage.mapped += file.size;
+#endif
+    }
+
+  private:
+    mapped_file file;
+    const flat_material* materials_data = nullptr;
+    const flat_primitive* primitives = nullptr;
+    const flat_node* nodes = nullptr;
+    std::vector<shared_ptr<material>> materials;
+    aabb bbox;
+
+    static const int max_depth = 64;// of the node tree, the size of hit's stack
+
+    mapped_scene() {}
+
+    static bool fits(uint64_t offset, uint64_t count, size_t record_size, size_t file_size) {
+        return offset % alignof(double) == 0 && offset <= file_size && count <= (file_size - offset) / record_size;
+    }
+
+    // checks every index in the mapped arrays is in range, and that no path through the nodes is
+    // deeper than hit's stack, so a corrupt file can't be traced out of bounds
+    static bool valid_indices(const mapped_scene& scene, const scene_cache_header& header) {
+        // children always come after their parent, so each node's depth is final before it's read
+        std::vector<uint8_t> depth(header.node_count, 0);
+        for (uint64_t i = 0; i < header.node_count; i++) {
+            const flat_node& node = scene.nodes[i];
+            if (node.count > 0 && (node.first < 0 || uint64_t(node.first) + node.count > header.primitive_count))
+                return false;
+            if (node.count == 0 && (i + 1 >= header.node_count || uint64_t(node.first) <= i + 1 || uint64_t(node.first) >= header.node_count))
+                return false;
+            if (node.count < 0)
+                return false;
+            if (node.count == 0) {
+                if (depth[i] + 1 >= max_depth)
+                    return false;
+                depth[i + 1] = std::max<uint8_t>(depth[i + 1], depth[i] + 1);
+                depth[node.first] = std::max<uint8_t>(depth[node.first], depth[i] + 1);
+            }
+        }
+        for (uint64_t i = 0; i < header.primitive_count; i++)
+            if (scene.primitives[i].material >= int64_t(header.material_count))
+                return false;
+        return true;
+    }
+
+    static shared_ptr<material> make_material(const flat_material& record) {
+        colour c(record.params[0], record.params[1], record.params[2]);
+        switch (record.type) {
+            case FLAT_LAMBERTIAN:    return make_shared<lambertian>(c);
+            case FLAT_METAL:         return make_shared<metal>(c, record.params[3]);
+            case FLAT_DIELECTRIC:    return make_shared<dielectric>(record.params[3]);
+            case FLAT_DIFFUSE_LIGHT: return make_shared<diffuse_light>(c);
+        }
+        return shared_ptr<material>();
+    }
+
+    static aabb node_bounds(const flat_node& node) {
+        const double* b = node.bounds;
+        return aabb(interval(b[0], b[1]), interval(b[2], b[3]), interval(b[4], b[5]));
+    }
+
+    static vec3 load_vec(const double* d) { return vec3(d[0], d[1], d[2]); }
+
+    bool hit_primitive(const flat_primitive& prim, const ray& r, interval ray_t, hit_record& rec) const {
+        if (prim.type == FLAT_SPHERE) {
+            RT_STAT(sphere_tests);
+            return hit_sphere(prim, r, ray_t, rec);
+        }
+        RT_STAT(quad_tests);
+        return hit_planar(prim, r, ray_t, rec);
+    }
+
+    bool hit_sphere(const flat_primitive& prim, const ray& r, interval ray_t, hit_record& rec) const {
+        // same intersection as sphere::hit
+        point3 center = load_vec(prim.data) + r.time()*load_vec(prim.data + 3);
+        double radius = prim.data[6];
+        vec3 offset_center = center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), offset_center);
+        auto c = offset_center.length_squared() - radius*radius;
+
+        auto discriminant = h*h - a*c;
+        if (discriminant < 0)
+            return false;
+
+        auto discriminant_sqrt = sqrt(discriminant);
+        auto root = (h - discriminant_sqrt) / a;
+        if (!ray_t.surrounds(root)) {
+            root = (h + discriminant_sqrt) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+
+        rec.t = root;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radius;
+        rec.set_face_normal(r, outward_normal);
+        auto theta = acos(-outward_normal.y());
+        auto phi = atan2(-outward_normal.z(), outward_normal.x()) + PI;
+        rec.u = phi / (2*PI);
+        rec.v = theta / PI;
+        rec.uv_scale = 0;// flattened materials are constant colours, so there's nothing to filter
+        rec.mat = material_at(prim.material);
+        rec.object_id = int(&prim - primitives);
+        return true;
+    }
+
+    bool hit_planar(const flat_primitive& prim, const ray& r, interval ray_t, hit_record& rec) const {
+        // same intersection as quad::hit with the interior test of each planar shape
+        vec3 normal = load_vec(prim.data + 9);
+        auto denominator = dot(normal, r.direction());
+        if (fabs(denominator) < 1e-8)
+            return false;
+
+        auto t = (prim.data[15] - dot(normal, r.origin())) / denominator;
+        if (!ray_t.contains(t))
+            return false;
+
+        auto intersection = r.at(t);
+        vec3 planar_hitpt_vector = intersection - load_vec(prim.data);
+        vec3 w = load_vec(prim.data + 12);
+        auto alpha = dot(w, cross(planar_hitpt_vector, load_vec(prim.data + 6)));
+        auto beta = dot(w, cross(load_vec(prim.data + 3), planar_hitpt_vector));
+
+        switch (prim.type) {
+            case FLAT_QUAD:
+                if (alpha < 0 || alpha > 1 || beta < 0 || beta > 1)
+                    return false;
+                rec.u = alpha;
+                rec.v = beta;
+                break;
+            case FLAT_TRIANGLE:
+                if (!(alpha > 0 && beta > 0 && alpha + beta < 1))
+                    return false;
+                rec.u = alpha;
+                rec.v = beta;
+                break;
+            case FLAT_ELLIPSE:
+                if ((alpha*alpha + beta*beta) > 1)
+                    return false;
+                rec.u = alpha/2 + 0.5;
+                rec.v = beta/2 + 0.5;
+                break;
+            case FLAT_ANNULUS: {
+                auto center_dist = sqrt(alpha*alpha + beta*beta);
+                if ((center_dist < prim.data[16]) || (center_dist > 1))
+                    return false;
+                rec.u = alpha/2 + 0.5;
+                rec.v = beta/2 + 0.5;
+                break;
+            }
+            default:
+                return false;
+        }
+
+        rec.t = t;
+        rec.p = intersection;
+        rec.uv_scale = 0;
+        rec.mat = material_at(prim.material);
+        rec.object_id = int(&prim - primitives);
+        rec.set_face_normal(r, normal);
+        return true;
+    }
+
+    shared_ptr<material> material_at(int32_t index) const {
+        return index < 0 ? shared_ptr<material>() : materials[index];
+    }
+};
+
+// Builds the flattened scene, its BVH and writes the cache file
+class scene_cache_builder {
+  public:
+    // Flattens the world, returns false if any object or material can't be cached
+    bool flatten(const hittable& world) {
+        if (!world.flatten(writer))
+            return false;
+
+        std::unordered_map<const material*, int32_t> material_indices;
+        for (size_t i = 0; i < writer.primitives.size(); i++) {
+            const material* mat = writer.primitive_materials[i];
+            if (mat == nullptr) {
+                writer.primitives[i].material = -1;
+                continue;
+            }
+            auto found = material_indices.find(mat);
+            if (found == material_indices.end()) {
+                flat_material record = {};
+                if (!mat->flatten(record))
+                    return false;
+                found = material_indices.emplace(mat, int32_t(materials.size())).first;
+                materials.push_back(record);
+            }
+            writer.primitives[i].material = found->second;
+        }
+        return !writer.primitives.empty();
+    }
+
+    // Builds the BVH over the flattened primitives and writes the cache file for the scene with key
+    bool write(const std::string& filename, uint64_t key) {
+        std::vector<int32_t> order(writer.primitives.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = int32_t(i);
+
+        nodes.clear();
+        build(order, 0, order.size());
+
+        scene_cache_header header = {};
+        std::memcpy(header.magic, "RTSC", 4);
+        header.version = scene_cache_version;
+        header.source_hash = key;
+        header.material_count = materials.size();
+        header.primitive_count = order.size();
+        header.node_count = nodes.size();
+        header.material_offset = sizeof(scene_cache_header);
+        header.primitive_offset = header.material_offset + materials.size() * sizeof(flat_material);
+        header.node_offset = header.primitive_offset + order.size() * sizeof(flat_primitive);
+
+        std::ofstream out(filename, std::ios::binary);
+        if (!out)
+            return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(materials.data()), materials.size() * sizeof(flat_material));
+        for (auto index : order)// primitives are stored in leaf order
+            out.write(reinterpret_cast<const char*>(&writer.primitives[index]), sizeof(flat_primitive));
+        out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(flat_node));
+        return bool(out);
+    }
+
+  private:
+    scene_writer writer;
+    std::vector<flat_material> materials;
+    std::vector<flat_node> nodes;
+
+    static aabb primitive_bounds(const flat_primitive& prim) {
+        auto d = prim.data;
+        if (prim.type == FLAT_SPHERE) {
+            auto center = vec3(d[0], d[1], d[2]);
+            auto radius_vec = vec3(d[6], d[6], d[6]);
+            auto center2 = center + vec3(d[3], d[4], d[5]);
+            return aabb(aabb(center - radius_vec, center + radius_vec), aabb(center2 - radius_vec, center2 + radius_vec));
+        }
+        auto Q = vec3(d[0], d[1], d[2]), u = vec3(d[3], d[4], d[5]), v = vec3(d[6], d[7], d[8]);
+        return aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v));
+    }
+
+    // Median split build matching bvh_node, nodes are laid out depth first
+    void build(std::vector<int32_t>& order, size_t start, size_t end) {
+        aabb bbox = aabb::empty;
+        for (size_t i = start; i < end; i++)
+            bbox = aabb(bbox, primitive_bounds(writer.primitives[order[i]]));
+
+        auto node_index = nodes.size();
+        flat_node node = {};
+        node.bounds[0] = bbox.x.min; node.bounds[1] = bbox.x.max;
+        node.bounds[2] = bbox.y.min; node.bounds[3] = bbox.y.max;
+        node.bounds[4] = bbox.z.min; node.bounds[5] = bbox.z.max;
+        nodes.push_back(node);
+
+        size_t object_span = end - start;
+        if (object_span <= 2) {
+            nodes[node_index].first = int32_t(start);
+            nodes[node_index].count = int32_t(object_span);
+            return;
+        }
+
+        int axis = bbox.longest_axis();
+        std::sort(order.begin() + start, order.begin() + end, [&](int32_t a, int32_t b) {
+            return primitive_bounds(writer.primitives[a]).axis_interval(axis).min
+                 < primitive_bounds(writer.primitives[b]).axis_interval(axis).min;
+        });
+
+        auto mid = start + object_span/2;
+        build(order, start, mid);
+        nodes[node_index].first = int32_t(nodes.size());// second child starts after the first subtree
+        nodes[node_index].count = 0;
+        build(order, mid, end);
+    }
+};
+
+// Cache key of a scene file, the hash of its text and the cache version
+inline uint64_t scene_cache_key(const std::string& source) {
+    auto hash = fnv1a(&scene_cache_version, sizeof(scene_cache_version));
+    return fnv1a(source.data(), source.size(), hash);
+}
+
+inline std::string scene_cache_filename(const std::string& cache_dir, uint64_t key) {
+    std::ostringstream filename;
+    filename << cache_dir << "/scene_" << std::hex << key << ".rtsc";
+    return filename.str();
+}
+
+// Returns the world traced from the cache file in cache_dir for the scene with key, or nullptr
+// if it hasn't been built
+inline shared_ptr<hittable> find_scene_cache(const std::string& cache_dir, uint64_t key) {
+    return mapped_scene::load(scene_cache_filename(cache_dir, key), key);
+}
+
+// Writes the cache file in cache_dir for the world built from the scene with key and returns the
+// world traced from it. Returns nullptr if the scene contains objects or materials that can't be
+// cached.
+inline shared_ptr<hittable> build_scene_cache(const hittable& world, const std::string& cache_dir, uint64_t key) {
+    scene_cache_builder builder;
+    if (!builder.flatten(world))
+        return nullptr;
+
+    auto filename = scene_cache_filename(cache_dir, key);
+    if (!builder.write(filename, key)) {
+        std::cerr << "ERROR: Could not write scene cache '" << filename << "'.\n";
+        return nullptr;
+    }
+    return mapped_scene::load(filename, key);
+}
+
+#endif
@@ -0,0 +1,454 @@
+#ifndef SCENE_LOADER_H
+#define SCENE_LOADER_H
+
+#include "headers.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "constant_medium_volume.h"
+#include "grid_volume.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "quad.h"
+#include "scene_store.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <initializer_list>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+// Text scene description, one statement per line and # starts a comment:
+//
+//   camera <setting> <values> ...      any number of settings per line
+//       aspect_ratio a | width n | spp n | max_depth n | fov degrees | lookfrom x y z | lookat x y z
+//       vup x y z | defocus_angle degrees | focus_dist d | background r g b
+//   texture <name> solid r g b
+//   texture <name> checker <scale> <even texture> <odd texture>
+//   texture <name> image <filename>
+//   texture <name> noise <scale> [bake <voxels> ax ay az bx by bz]
+//                                            with bake the noise inside the box is sampled once into a grid of <voxels>
+//                                            along the box's longest side and interpolated from there
+//   material <name> lambertian <texture | r g b>
+//   material <name> metal r g b <fuzz>
+//   material <name> dielectric <refraction index>
+//   material <name> diffuse_light <texture | r g b>
+//   material <name> isotropic <texture | r g b>
+//   sphere <material> x y z <radius>
+//   moving_sphere <material> x1 y1 z1 x2 y2 z2 <radius>
+//   quad | triangle | ellipse <material> Qx Qy Qz ux uy uz vx vy vz
+//   annulus <material> Qx Qy Qz ux uy uz vx vy vz <inner radius>
+//   box <material> ax ay az bx by bz
+//   light <primitive without a material>     adds the shape to the lights that are importance sampled
+//   bvh                                      builds a bvh over the world once it is loaded
+//
+// Primitives can be followed by modifiers that are applied in order:
+//   rotate_y degrees | translate x y z | medium <density> <texture | r g b>
+//   cloud <density> <noise scale> <voxels> <texture | r g b>   fills the shape with patchy noise in a grid of
+//                                                              <voxels> along the longest side of its bounding box
+
+class scene {
+  public:
+    scene_store store;// makes the primitives, materials and textures
+    hittable_list world;
+    hittable_list lights;
+    camera cam;
+};
+
+class scene_loader {
+  public:
+    // Loads the scene file, returns false and prints the line of the first error if it fails
+    bool load(const std::string& filename, scene& out) {
+        std::string text;
+        return read(filename, text) && parse(text, filename, out);
+    }
+
+    // Reads the scene file into text, returns false and prints an error if it can't be opened
+    static bool read(const std::string& filename, std::string& text) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) {
+            std::cerr << "ERROR: Could not open scene file '" << filename << "'.\n";
+            return false;
+        }
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        text = contents.str();
+        return true;
+    }
+
+    // Parses the scene text in a single pass, name is used for error messages. Without build_world
+    // the primitives and the bvh are skipped, for a world that is traced from the scene cache;
+    // the camera, lights, materials and textures are still loaded.
+    bool parse(const std::string& text, const std::string& name, scene& out, bool build_world = true) {
+        source = text.c_str();
+        cursor = source;
+        line = 1;
+        source_name = name;
+        store = &out.store;
+        textures.clear();
+        materials.clear();
+        bool use_bvh = false;
+
+        while (next_line()) {
+            auto keyword = token();
+            bool ok;
+            if (keyword == "camera")        ok = parse_camera(out.cam);
+            else if (keyword == "texture")  ok = parse_texture();
+            else if (keyword == "material") ok = parse_material();
+            else if (keyword == "light")    ok = parse_light(out.lights);
+            else if (keyword == "bvh")      ok = use_bvh = true;
+            else if (!build_world)          ok = skip_line();
+            else {
+                shared_ptr<hittable> object;
+                ok = parse_primitive(keyword, true, object) && parse_modifiers(object);
+                if (ok)
+                    out.world.add(object);
+            }
+            if (!ok)
+                return false;
+            if (!at_line_end())
+                return error("unexpected '" + token() + "'");
+        }
+
+        if (use_bvh && !out.world.hittable_objects.empty())
+            out.world = hittable_list(make_shared<bvh_node>(out.world));
+        load_queue::global().wait();// images decode while the rest of the scene loads
+        return true;
+    }
+
+  private:
+    const char* source;
+    const char* cursor;
+    int line;
+    std::string source_name;
+    scene_store* store;
+    std::unordered_map<std::string, shared_ptr<texture>> textures;
+    std::unordered_map<std::string, shared_ptr<material>> materials;
+
+    bool error(const std::string& message) {
+        std::cerr << "ERROR: " << source_name << ":" << line << ": " << message << "\n";
+        return false;
+    }
+
+    void skip_spaces() {
+        while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')
+            cursor++;
+        if (*cursor == '#')// comments run to the end of the line
+            while (*cursor != '\0' && *cursor != '\n')
+                cursor++;
+    }
+
+    bool skip_line() {
+        while (*cursor != '\0' && *cursor != '\n')
+            cursor++;
+        return true;
+    }
+
+    bool at_line_end() {
+        skip_spaces();
+        return *cursor == '\0' || *cursor == '\n';
+    }
+
+    // moves to the start of the next statement, skipping blank lines, returns false at the end of the file
+    bool next_line() {
+        while (true) {
+            skip_spaces();
+            if (*cursor == '\0')
+                return false;
+            if (*cursor != '\n')
+                return true;
+            cursor++;
+            line++;
+        }
+    }
+
+    std::string token() {
+        skip_spaces();
+        auto start = cursor;
+        while (*cursor != '\0' && !std::isspace((unsigned char)*cursor))
+            cursor++;
+        return std::string(start, cursor);
+    }
+
+    bool number_next() {
+        skip_spaces();
+        return std::isdigit((unsigned char)*cursor) || *cursor == '-' || *cursor == '+' || *cursor == '.';
+    }
+
+    bool number(double& value) {
+        skip_spaces();
+        char* end;
+        value = std::strtod(cursor, &end);
+        if (end == cursor || (*end != '\0' && !std::isspace((unsigned char)*end)))
+            return error("expected a number");
+        cursor = end;
+        return true;
+    }
+
+    bool number(int& value) {
+        double d;
+        if (!number(d))
+            return false;
+        value = int(d);
+        return true;
+    }
+
+    bool vector(vec3& value) {
+        double x, y, z;
+        if (!number(x) || !number(y) || !number(z))
+            return false;
+        value = vec3(x, y, z);
+        return true;
+    }
+
+    bool parse_camera(camera& cam) {
+        while (!at_line_end()) {
+            auto setting = token();
+            bool ok;
+            if (setting == "aspect_ratio")       ok = number(cam.aspect_ratio);
+            else if (setting == "width")         ok = number(cam.image_width);
+            else if (setting == "spp")           ok = number(cam.samples_per_pixel);
+            else if (setting == "max_depth")     ok = number(cam.max_depth);
+            else if (setting == "fov")           ok = number(cam.fov);
+            else if (setting == "lookfrom")      ok = vector(cam.cam_center);
+            else if (setting == "lookat")        ok = vector(cam.look_point);
+            else if (setting == "vup")           ok = vector(cam.vup);
+            else if (setting == "defocus_angle") ok = number(cam.defocus_angle);
+            else if (setting == "focus_dist")    ok = number(cam.focus_dist);
+            else if (setting == "background")    ok = vector(cam.background_colour);
+            else return error("unknown camera setting '" + setting + "'");
+            if (!ok)
+                return false;
+        }
+        return true;
+    }
+
+    // a named texture or an inline r g b colour
+    bool texture_or_colour(shared_ptr<texture>& tex) {
+        if (number_next()) {
+            colour albedo;
+            if (!vector(albedo))
+                return false;
+            tex = solid(albedo);
+            return true;
+        }
+        return find(textures, "texture", tex);
+    }
+
+    // Solid colours are shared between everything that uses the same colour, which also lets
+    // materials using them be deduplicated by the texture's address
+    shared_ptr<texture> solid(const colour& albedo) {
+        return store->make_deduplicated<solid_color>("solid " + numbers({ albedo.x(), albedo.y(), albedo.z() }), albedo);
+    }
+
+    static std::string numbers(std::initializer_list<double> values) {
+        std::ostringstream out;
+        out << std::setprecision(17);
+        for (auto value : values)
+            out << value << ' ';
+        return out.str();
+    }
+
+    static std::string address(const void* object) {
+        std::ostringstream out;
+        out << object;
+        return out.str();
+    }
+
+    template <typename T>
+    bool find(const std::unordered_map<std::string, shared_ptr<T>>& table, const char* kind, shared_ptr<T>& value) {
+        auto name = token();
+        auto found = table.find(name);
+        if (found == table.end())
+            return error(std::string("unknown ") + kind + " '" + name + "'");
+        value = found->second;
+        return true;
+    }
+
+    bool parse_texture() {
+        auto name = token();
+        auto type = token();
+        shared_ptr<texture> tex;
+        if (type == "solid") {
+            colour albedo;
+            if (!vector(albedo))
+                return false;
+            tex = solid(albedo);
+        } else if (type == "checker") {
+            double scale;
+            shared_ptr<texture> even, odd;
+            if (!number(scale) || !find(textures, "texture", even) || !find(textures, "texture", odd))
+                return false;
+            tex = store->make<checker_texture>(scale, even, odd);
+        } else if (type == "image") {
+            auto filename = token();
+            if (filename.empty())
+                return error("expected an image filename");
+            tex = store->make<image_texture>(filename.c_str());
+        } else if (type == "noise") {
+            double scale;
+            if (!number(scale))
+                return false;
+            auto noise = store->make<noise_texture>(scale);
+            if (!at_line_end()) {// bake <voxels> ax ay az bx by bz
+                if (token() != "bake")
+                    return error("expected bake after the noise scale");
+                double voxels;
+                point3 a, b;
+                if (!number(voxels) || !vector(a) || !vector(b))
+                    return false;
+                if (voxels < 1 || voxels > 1024)
+                    return error("noise bake needs 1 to 1024 voxels");
+                for (int axis = 0; axis < 3; axis++)// a flat box would give the grid cells of no size
+                    if (!(std::fabs(b[axis] - a[axis]) > 0) || !std::isfinite(b[axis] - a[axis]))
+                        return error("noise bake box needs a size along every axis");
+                noise->bake(aabb(a, b), int(voxels));
+            }
+            tex = noise;
+        } else {
+            return error("unknown texture type '" + type + "'");
+        }
+        textures[name] = tex;
+        return true;
+    }
+
+    bool parse_material() {
+        auto name = token();
+        auto type = token();
+        shared_ptr<material> mat;
+        shared_ptr<texture> tex;
+        if (type == "lambertian") {
+            if (!texture_or_colour(tex))
+                return false;
+            mat = store->make_deduplicated<lambertian>("lambertian " + address(tex.get()), tex);
+        } else if (type == "metal") {
+            colour albedo;
+            double fuzz;
+            if (!vector(albedo) || !number(fuzz))
+                return false;
+            mat = store->make_deduplicated<metal>("metal " + numbers({ albedo.x(), albedo.y(), albedo.z(), fuzz }), albedo, fuzz);
+        } else if (type == "dielectric") {
+            double refraction_index;
+            if (!number(refraction_index))
+                return false;
+            mat = store->make_deduplicated<dielectric>("dielectric " + numbers({ refraction_index }), refraction_index);
+        } else if (type == "diffuse_light") {
+            if (!texture_or_colour(tex))
+                return false;
+            mat = store->make_deduplicated<diffuse_light>("diffuse_light " + address(tex.get()), tex);
+        } else if (type == "isotropic") {
+            if (!texture_or_colour(tex))
+                return false;
+            mat = store->make_deduplicated<isotropic>("isotropic " + address(tex.get()), tex);
+        } else {
+            return error("unknown material type '" + type + "'");
+        }
+        materials[name] = mat;
+        return true;
+    }
+
+    bool parse_light(hittable_list& lights) {
+        shared_ptr<hittable> object;
+        if (!parse_primitive(token(), false, object) || !parse_modifiers(object))
+            return false;
+        lights.add(object);
+        return true;
+    }
+
+    // parses the primitive after its keyword, lights have no material
+    bool parse_primitive(const std::string& type, bool has_material, shared_ptr<hittable>& object) {
+        shared_ptr<material> mat;
+        if (has_material && !find(materials, "material", mat))
+            return false;
+
+        if (type == "sphere") {
+            point3 center;
+            double radius;
+            if (!vector(center) || !number(radius))
+                return false;
+            object = store->make<sphere>(center, radius, mat);
+        } else if (type == "moving_sphere") {
+            point3 center1, center2;
+            double radius;
+            if (!vector(center1) || !vector(center2) || !number(radius))
+                return false;
+            object = store->make<sphere>(center1, center2, radius, mat);
+        } else if (type == "quad" || type == "triangle" || type == "ellipse" || type == "annulus") {
+            point3 Q;
+            vec3 u, v;
+            if (!vector(Q) || !vector(u) || !vector(v))
+                return false;
+            if (type == "quad")          object = store->make<quad>(Q, u, v, mat);
+            else if (type == "triangle") object = store->make<triangle>(Q, u, v, mat);
+            else if (type == "ellipse")  object = store->make<ellipse>(Q, u, v, mat);
+            else {
+                double inner;
+                if (!number(inner))
+                    return false;
+                object = store->make<annulus>(Q, u, v, inner, mat);
+            }
+        } else if (type == "box") {
+            point3 a, b;
+            if (!vector(a) || !vector(b))
+                return false;
+            object = box(a, b, mat);
+        } else {
+            return error("unknown statement '" + type + "'");
+        }
+        return true;
+    }
+
+    // Low frequency noise with finer detail on top, cut off below a threshold so most of the space is empty
+    static shared_ptr<density_grid> cloud_grid(const aabb& bounds, double density, double scale, int voxels) {
+        double voxel_size = bounds.axis_interval(bounds.longest_axis()).size() / voxels;
+        auto grid = make_shared<density_grid>(bounds, int(std::ceil(bounds.x.size() / voxel_size)),
+                                              int(std::ceil(bounds.y.size() / voxel_size)), int(std::ceil(bounds.z.size() / voxel_size)));
+        perlin noise;
+        grid->fill([&](const point3& p) {
+            return density * (noise.noise(scale * p) + 0.25 * noise.octave(4 * scale * p, 4) - 0.35);
+        });
+        return grid;
+    }
+
+    bool parse_modifiers(shared_ptr<hittable>& object) {
+        while (!at_line_end()) {
+            auto modifier = token();
+            if (modifier == "rotate_y") {
+                double angle;
+                if (!number(angle))
+                    return false;
+                object = store->make<rotate_y>(object, angle);
+            } else if (modifier == "translate") {
+                vec3 offset;
+                if (!vector(offset))
+                    return false;
+                object = store->make<translate>(object, offset);
+            } else if (modifier == "medium") {
+                double density;
+                shared_ptr<texture> tex;
+                if (!number(density) || !texture_or_colour(tex))
+                    return false;
+                object = store->make<constant_medium>(object, density, tex);
+            } else if (modifier == "cloud") {
+                double density, scale, voxels;
+                shared_ptr<texture> tex;
+                if (!number(density) || !number(scale) || !number(voxels) || !texture_or_colour(tex))
+                    return false;
+                if (voxels < 1)
+                    return error("cloud needs at least one voxel");
+                object = store->make<grid_medium>(object, cloud_grid(object->bounding_box(), density, scale, int(voxels)), tex);
+            } else {
+                return error("unknown modifier '" + modifier + "'");
+            }
+        }
+        return true;
+    }
+};
+
+#endif
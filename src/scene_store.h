@@ -0,0 +1,225 @@
+#ifndef SCENE_STORE_H
+#define SCENE_STORE_H
+
+#include "headers.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+
+#include <iomanip>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+// Arena for the objects a scene is built from. Each concrete type gets its own pool, which keeps
+// its objects next to each other in chunks that double in size, starting small so a type with a
+// few objects doesn't reserve much. make() places each object and its control block in the pool
+// with allocate_shared, so the shared_ptrs it hands out own the object like make_shared's do, and
+// every control block keeps the pool's memory alive until the last object in it is gone.
+// Materials and textures can be deduplicated by a key describing their parameters.
+
+enum scene_category {
+    CATEGORY_GEOMETRY = 0,
+    CATEGORY_MATERIALS = 1,
+    CATEGORY_TEXTURES = 2,
+    CATEGORY_OTHER = 3,
+};
+
+// Chunks of memory that the objects of one pool are placed in one after another. Slots are never
+// reused, the chunks are freed together when the arena is.
+class scene_arena {
+  public:
+    static const int first_chunk_size = 8;// slots in the first chunk, each one after it holds twice as many
+
+    scene_arena() {}
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+
+    // the pool always asks for the same size, that of one control block with its object in it
+    void* allocate(size_t size) {
+        if (slot_words == 0)
+            slot_words = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+        if (used == capacity) {
+            size_t slots = size_t(first_chunk_size) << chunks.size();
+            chunks.emplace_back(new std::max_align_t[slots * slot_words]);
+            capacity += slots;
+            last_chunk_start = used;
+        }
+        return &chunks.back()[(used++ - last_chunk_start) * slot_words];
+    }
+
+    size_t bytes() const { return capacity * slot_words * sizeof(std::max_align_t); }
+
+  private:
+    std::vector<std::unique_ptr<std::max_align_t[]>> chunks;
+    size_t slot_words = 0;// size of a slot in units of max_align_t
+    size_t capacity = 0;// slots in all the chunks
+    size_t used = 0;
+    size_t last_chunk_start = 0;// index of the first slot in the newest chunk
+};
+
+// Allocator that allocate_shared places an object with in an arena, the control block it makes
+// holds a copy and with it a reference to the arena
+template <typename U>
+class scene_allocator {
+  public:
+    using value_type = U;
+
+    explicit scene_allocator(shared_ptr<scene_arena> arena) : arena(std::move(arena)) {}
+
+    template <typename V>
+    scene_allocator(const scene_allocator<V>& other) : arena(other.arena) {}
+
+    U* allocate(size_t n) {
+        static_assert(alignof(U) <= alignof(std::max_align_t), "scene objects can't be over-aligned");
+        return static_cast<U*>(arena->allocate(n * sizeof(U)));
+    }
+
+    void deallocate(U*, size_t) {}// the arena frees its chunks together
+
+    template <typename V>
+    bool operator==(const scene_allocator<V>& other) const { return arena == other.arena; }
+
+    template <typename V>
+    bool operator!=(const scene_allocator<V>& other) const { return arena != other.arena; }
+
+    shared_ptr<scene_arena> arena;
+};
+
+class scene_pool_base {
+  public:
+    virtual ~scene_pool_base() = default;
+    virtual size_t size() const = 0;
+    virtual size_t bytes() const = 0;// memory reserved for the pool's chunks
+    virtual scene_category category() const = 0;
+    virtual size_t data_bytes() const = 0;// memory the objects hold outside the pool, like texture pixels
+};
+
+template <typename T>
+class scene_pool : public scene_pool_base {
+  public:
+    scene_pool() : arena(make_shared<scene_arena>()) {}
+    scene_pool(const scene_pool&) = delete;
+    scene_pool& operator=(const scene_pool&) = delete;
+
+    template <typename... Args>
+    shared_ptr<T> make(Args&&... args) {
+        auto object = std::allocate_shared<T>(scene_allocator<T>(arena), std::forward<Args>(args)...);
+        objects.push_back(object);
+        return object;
+    }
+
+    size_t size() const override { return objects.size(); }
+    size_t bytes() const override { return arena->bytes(); }
+
+    scene_category category() const override {
+        if (std::is_base_of<hittable, T>::value) return CATEGORY_GEOMETRY;
+        if (std::is_base_of<material, T>::value) return CATEGORY_MATERIALS;
+        if (std::is_base_of<texture, T>::value)  return CATEGORY_TEXTURES;
+        return CATEGORY_OTHER;
+    }
+
+    size_t data_bytes() const override {
+        size_t total = 0;
+        if constexpr (std::is_base_of<texture, T>::value)
+            for (const auto& object : objects)
+                if (auto alive = object.lock())
+                    total += alive->data_bytes();
+        return total;
+    }
+
+  private:
+    shared_ptr<scene_arena> arena;
+    std::vector<std::weak_ptr<T>> objects;// weak so the pool doesn't keep objects the scene has dropped
+};
+
+class scene_store {
+  public:
+    scene_store() {}
+    scene_store(const scene_store&) = delete;
+    scene_store& operator=(const scene_store&) = delete;
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) {
+        return pool<T>().make(std::forward<Args>(args)...);
+    }
+
+    // Returns the object made earlier with the same key, or makes it. The key has to describe
+    // everything that makes the object what it is, for example its type and parameters.
+    template <typename T, typename... Args>
+    shared_ptr<T> make_deduplicated(const std::string& key, Args&&... args) {
+        auto found = deduplicated.find(key);
+        if (found != deduplicated.end()) {
+            reused[pool<T>().category()]++;
+            return std::static_pointer_cast<T>(found->second);
+        }
+        auto object = make<T>(std::forward<Args>(args)...);
+        deduplicated[key] = object;
+        return object;
+    }
+
+    size_t count(scene_category category) const {
+        size_t total = 0;
+        for (const auto& entry : pools)
+            if (entry.second->category() == category)
+                total += entry.second->size();
+        return total;
+    }
+
+    size_t bytes(scene_category category) const {
+        size_t total = 0;
+        for (const auto& entry : pools)
+            if (entry.second->category() == category)
+                total += entry.second->bytes();
+        return total;
+    }
+
+    // Adds the materials and textures to usage, the geometry is counted by walking the world
+    void measure(memory_usage& usage) const {
+        for (const auto& entry : pools) {
+            if (entry.second->category() == CATEGORY_MATERIALS)
+                usage.materials += entry.second->bytes();
+            else if (entry.second->category() == CATEGORY_TEXTURES)
+                usage.textures += entry.second->bytes() + entry.second->data_bytes();
+        }
+    }
+
+    // Objects handed out again instead of being made twice
+    size_t reused_count(scene_category category) const {
+        return reused[category];
+    }
+
+    void report(std::ostream& out) const {
+        const char* names[] = { "geometry", "materials", "textures", "other" };
+        for (int c = CATEGORY_GEOMETRY; c <= CATEGORY_OTHER; c++) {
+            auto category = scene_category(c);
+            if (category == CATEGORY_OTHER && count(category) == 0)
+                continue;
+            out << std::left << std::setw(11) << names[c] << std::right << std::setw(8) << count(category) << " objects "
+                << std::setw(10) << bytes(category) << " bytes";
+            if (reused_count(category) > 0)
+                out << ", " << reused_count(category) << " duplicates shared";
+            out << "\n";
+        }
+    }
+
+  private:
+    std::unordered_map<std::type_index, std::unique_ptr<scene_pool_base>> pools;
+    std::unordered_map<std::string, shared_ptr<void>> deduplicated;
+    size_t reused[4] = { 0, 0, 0, 0 };
+
+    template <typename T>
+    scene_pool<T>& pool() {
+        auto& entry = pools[std::type_index(typeid(T))];
+        if (entry == nullptr)
+            entry.reset(new scene_pool<T>());
+        return static_cast<scene_pool<T>&>(*entry);
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "onb.h"
+#include "stats.h"
 class sphere : public hittable {
   public:
     //stationary sphere
@@ -23,6 +24,7 @@ class sphere : public hittable {
         displacement = center2 - center1;
     }
     bool hit(const ray& r, interval ray_t, hit_record& record) const override {
+        RT_STAT(sphere_tests);
         point3 center = is_moving ? sphere_center(r.time()) : m_center;
         vec3 offsetCenter= center - r.origin();// sphere's position relative to the ray start
         auto a = r.direction().length_squared(); //derived value for a in quadratic to find the t intercections with the sphere
@@ -49,11 +51,41 @@ class sphere : public hittable {
         vec3 outward_normal = (record.p - center) / m_radius;
         record.set_face_normal(r, outward_normal);
         get_sphere_uv(outward_normal, record.u, record.v);
+        record.uv_scale = 1 / (2*PI * m_radius);// u runs once around the equator
         record.mat = m_mat;
+        record.object_id = object_id;
         return true;
     }
     aabb bounding_box() const override { return bbox; }
 
+    bool surface_crossings(const ray& r, interval ray_t, std::vector<double>& crossings) const override {
+        RT_STAT(sphere_tests);
+        point3 center = is_moving ? sphere_center(r.time()) : m_center;
+        vec3 offsetCenter = center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), offsetCenter);
+        auto c = offsetCenter.length_squared() - m_radius*m_radius;
+
+        auto discriminant = h*h - a*c;
+        if (discriminant <= 0)// a ray grazing the sphere doesn't go inside
+            return true;
+
+        auto discriminant_sqrt = sqrt(discriminant);
+        for (auto root : { (h - discriminant_sqrt) / a, (h + discriminant_sqrt) / a })
+            if (ray_t.contains(root))
+                crossings.push_back(root);
+        return true;
+    }
+
+    bool flatten(scene_writer& writer) const override {
+        writer.add_sphere(m_center, is_moving ? displacement : vec3(0,0,0), m_radius, m_mat.get());
+        return true;
+    }
+
+    void measure(memory_usage& usage) const override {
+        usage.geometry += sizeof(sphere);
+    }
+
     double pdf_value(const point3& origin, const vec3& direction) const override {
         // This method only works for stationary spheres.
 
@@ -80,7 +112,7 @@ class sphere : public hittable {
     point3 m_center;
     double m_radius;
     shared_ptr<material> m_mat;
-    bool is_moving;
+    bool is_moving = false;
     vec3 displacement;
     aabb bbox;
 
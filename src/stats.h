@@ -0,0 +1,131 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "headers.h"
+
+#include <iomanip>
+#include <mutex>
+
+// Hot path counters for finding out why a scene is slow. Each thread counts into its own
+// thread_local copy, which is merged into the totals when the thread finishes rendering. When
+// RT_ENABLE_STATS isn't defined the macros compile to nothing.
+
+class render_stats {
+  public:
+    static const int max_bounces = 64;// deeper bounces are counted in the last histogram bucket
+
+    unsigned long long bvh_nodes_visited = 0;
+    unsigned long long aabb_tests = 0;
+    unsigned long long sphere_tests = 0;
+    unsigned long long quad_tests = 0;// including triangles, ellipses and annuli
+    unsigned long long medium_tests = 0;
+    unsigned long long pdf_evaluations = 0;
+    unsigned long long scatter_calls = 0;
+
+    // how each path segment in camera::ray_colour ended
+    unsigned long long background_hits = 0;
+    unsigned long long absorbed = 0;
+    unsigned long long specular_bounces = 0;
+    unsigned long long sampled_bounces = 0;
+    unsigned long long depth_limit = 0;
+
+    unsigned long long path_length[max_bounces] = {};// histogram of bounces when paths terminate
+
+    // this thread's counters
+    static render_stats& local() {
+        thread_local render_stats stats;
+        return stats;
+    }
+
+    // adds this thread's counters to the totals and clears them
+    static void merge_local() {
+        std::lock_guard<std::mutex> lock(totals_mutex());
+        totals().add(local());
+        local() = render_stats();
+    }
+
+    // takes the merged totals, clearing them for the next render
+    static render_stats take_totals() {
+        std::lock_guard<std::mutex> lock(totals_mutex());
+        auto result = totals();
+        totals() = render_stats();
+        return result;
+    }
+
+    void record_path_end(int bounces) {
+        path_length[bounces < max_bounces ? bounces : max_bounces - 1]++;
+    }
+
+    void print(std::ostream& out) const {
+        out << "Render statistics\n" << std::left;
+        print_line(out, "BVH nodes visited", bvh_nodes_visited);
+        print_line(out, "AABB tests", aabb_tests);
+        print_line(out, "Sphere tests", sphere_tests);
+        print_line(out, "Quad tests", quad_tests);
+        print_line(out, "Medium tests", medium_tests);
+        print_line(out, "PDF evaluations", pdf_evaluations);
+        print_line(out, "Material scatters", scatter_calls);
+        print_line(out, "Background hits", background_hits);
+        print_line(out, "Absorbed", absorbed);
+        print_line(out, "Specular bounces", specular_bounces);
+        print_line(out, "Sampled bounces", sampled_bounces);
+        print_line(out, "Depth limit", depth_limit);
+
+        unsigned long long largest = 0, paths = 0;
+        int last = 0;
+        for (int i = 0; i < max_bounces; i++) {
+            paths += path_length[i];
+            if (path_length[i] > largest) largest = path_length[i];
+            if (path_length[i] > 0) last = i;
+        }
+        out << "Path length histogram (" << paths << " paths)\n";
+        for (int i = 0; i <= last && largest > 0; i++) {
+            int bar = int(40 * path_length[i] / largest);
+            out << std::right << std::setw(4) << i << " " << std::setw(12) << path_length[i] << " "
+                << std::string(bar, '#') << "\n";
+        }
+        out << std::left;
+    }
+
+  private:
+    void add(const render_stats& other) {
+        bvh_nodes_visited += other.bvh_nodes_visited;
+        aabb_tests += other.aabb_tests;
+        sphere_tests += other.sphere_tests;
+        quad_tests += other.quad_tests;
+        medium_tests += other.medium_tests;
+        pdf_evaluations += other.pdf_evaluations;
+        scatter_calls += other.scatter_calls;
+        background_hits += other.background_hits;
+        absorbed += other.absorbed;
+        specular_bounces += other.specular_bounces;
+        sampled_bounces += other.sampled_bounces;
+        depth_limit += other.depth_limit;
+        for (int i = 0; i < max_bounces; i++)
+            path_length[i] += other.path_length[i];
+    }
+
+    static void print_line(std::ostream& out, const char* name, unsigned long long value) {
+        out << "  " << std::setw(20) << name << value << "\n";
+    }
+
+    static render_stats& totals() {
+        static render_stats stats;
+        return stats;
+    }
+
+    static std::mutex& totals_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+};
+
+#ifdef RT_ENABLE_STATS
+    #define RT_STAT(counter) (render_stats::local().counter++)
+    #define RT_STAT_PATH_END(bounces) (render_stats::local().record_path_end(bounces))
+#else
+    #define RT_STAT(counter) ((void)0)
+    #define RT_STAT_PATH_END(bounces) ((void)0)
+#endif
+
+#endif
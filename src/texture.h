@@ -3,16 +3,152 @@
 
 #include "headers.h"
 
+#include "aabb.h"
 #include "perlin.h"
 #include "image_manager.h"
+#include "load_queue.h"
+#include "texture_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class texture_program;
 
 class texture {
   public:
     virtual ~texture() = default;
 
     virtual colour value(double u, double v, const point3& pos) const = 0;//texture coords uv, and position p
+
+    // value averaged over an area about footprint across in uv units, for textures that can filter to
+    // keep distant detail from aliasing. A footprint of 0 is a point lookup
+    virtual colour value(double u, double v, const point3& pos, double footprint) const {
+        return value(u, v, pos);
+    }
+
+    // add this texture's instructions to the program and return the index of its first, see
+    // texture_program. Textures the program doesn't know are called through value()
+    virtual int emit(texture_program& program) const;
+
+    // bytes the texture holds outside the object itself, like decoded pixels
+    virtual size_t data_bytes() const { return 0; }
+};
+
+// Texture trees compiled into a flat array of instructions when a material is made, so a lookup
+// is a loop over plain records instead of a chain of virtual calls through shared pointers. Each
+// instruction either gives the colour or, for a checker, picks the instruction to go to next.
+// Batches of lookups are split between the checker's two sides and each side is evaluated for
+// all its lookups at once.
+
+enum texture_op_type : int {
+    TEXTURE_SOLID = 0,
+    TEXTURE_CHECKER = 1,
+    TEXTURE_IMAGE = 2,
+    TEXTURE_NOISE = 3,
+    TEXTURE_VIRTUAL = 4,// any other texture, called through texture::value
+};
+
+struct texture_op {
+    texture_op_type type;
+    int even, odd;// checker: instructions of the two sides
+    double inv_scale;// checker
+    colour albedo;// solid
+    const texture* source;// image, noise and virtual: the texture, which the program's owner keeps alive
+};
+
+struct texture_query {
+    double u, v;
+    point3 p;
+    double footprint;
+};
+
+class texture_program {
+  public:
+    texture_program() {}
+    explicit texture_program(const texture& root_texture) {
+        root = compile(root_texture);
+        compiled.clear();
+    }
+
+    colour value(double u, double v, const point3& p, double footprint) const;
+
+    // value of count lookups at once, out[i] is the colour of queries[i]
+    void value(const texture_query* queries, colour* out, int count) const {
+        thread_local std::vector<int> indices;// kept so batches don't allocate
+        indices.resize(count);
+        for (int i = 0; i < count; i++)
+            indices[i] = i;
+        evaluate(root, queries, indices.data(), count, out);
+    }
+
+    // index of the texture's instructions, a texture reached twice in the tree is only compiled once
+    int compile(const texture& tex) {
+        auto found = compiled.find(&tex);
+        if (found != compiled.end())
+            return found->second;
+        int index = tex.emit(*this);
+        compiled[&tex] = index;
+        return index;
+    }
+
+    int add(const texture_op& op) {
+        ops.push_back(op);
+        return int(ops.size()) - 1;
+    }
+
+    size_t size() const { return ops.size(); }
+
+  private:
+    std::vector<texture_op> ops;
+    int root = -1;
+    std::unordered_map<const texture*, int> compiled;// only used while compiling
+
+    static bool checker_even(const texture_op& op, const point3& p) {
+        auto xInteger = int(std::floor(op.inv_scale * p.x()));
+        auto yInteger = int(std::floor(op.inv_scale * p.y()));
+        auto zInteger = int(std::floor(op.inv_scale * p.z()));
+        return (xInteger + yInteger + zInteger) % 2 == 0;
+    }
+
+    colour leaf_value(const texture_op& op, double u, double v, const point3& p, double footprint) const;
+
+    void evaluate(int pc, const texture_query* queries, int* indices, int count, colour* out) const {
+        const auto& op = ops[pc];
+        if (op.type == TEXTURE_CHECKER) {
+            // partition the lookups in place, even ones first
+            int even_count = 0;
+            for (int i = 0; i < count; i++)
+                if (checker_even(op, queries[indices[i]].p))
+                    std::swap(indices[i], indices[even_count++]);
+            if (even_count > 0)
+                evaluate(op.even, queries, indices, even_count, out);
+            if (even_count < count)
+                evaluate(op.odd, queries, indices + even_count, count - even_count, out);
+            return;
+        }
+        if (op.type == TEXTURE_SOLID) {
+            for (int i = 0; i < count; i++)
+                out[indices[i]] = op.albedo;
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            const auto& q = queries[indices[i]];
+            out[indices[i]] = leaf_value(op, q.u, q.v, q.p, q.footprint);
+        }
+    }
 };
 
+inline int texture::emit(texture_program& program) const {
+    texture_op op = {};
+    op.type = TEXTURE_VIRTUAL;
+    op.source = this;
+    return program.add(op);
+}
+
 class solid_color : public texture {
   public:
     solid_color(const colour& albedo) : m_albedo(albedo) {}
@@ -23,6 +159,13 @@ class solid_color : public texture {
         return m_albedo;
     }
 
+    int emit(texture_program& program) const override {
+        texture_op op = {};
+        op.type = TEXTURE_SOLID;
+        op.albedo = m_albedo;
+        return program.add(op);
+    }
+
   private:
     colour m_albedo;
 };
@@ -48,6 +191,24 @@ class checker_texture : public texture {
         return isEven ? even->value(u, v, p) : odd->value(u, v, p);//returns the even or odd texture accordingly
     }
 
+    colour value(double u, double v, const point3& p, double footprint) const override {
+        auto xInteger = int(std::floor(inv_scale * p.x()));
+        auto yInteger = int(std::floor(inv_scale * p.y()));
+        auto zInteger = int(std::floor(inv_scale * p.z()));
+
+        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+        return isEven ? even->value(u, v, p, footprint) : odd->value(u, v, p, footprint);
+    }
+
+    int emit(texture_program& program) const override {
+        texture_op op = {};
+        op.type = TEXTURE_CHECKER;
+        op.inv_scale = inv_scale;
+        op.even = program.compile(*even);
+        op.odd = program.compile(*odd);
+        return program.add(op);
+    }
+
   private:
     double inv_scale;//input value scale?
     shared_ptr<texture> even;
@@ -56,26 +217,119 @@ class checker_texture : public texture {
 
 class image_texture : public texture {
   public:
-    image_texture(const char* filename) : image(filename) {}
+    // The image is decoded on the load queue while the scene goes on loading, the first lookup
+    // waits for it if it isn't done yet. With the texture cache enabled the image is paged in by
+    // tiles, otherwise all of it is decoded into memory.
+    image_texture(const char* filename) {
+        loading = load_queue::global().submit([this, name = std::string(filename)] {
+            auto& cache = texture_cache::global();
+            if (cache.enabled())
+                tiles = cache.open(name);
+            else
+                image.open(name);
+        });
+    }
+
+    ~image_texture() {
+        loading.wait();
+    }
+
+    int emit(texture_program& program) const override {
+        texture_op op = {};
+        op.type = TEXTURE_IMAGE;
+        op.source = this;
+        return program.add(op);
+    }
 
     colour value(double u, double v, const point3& p) const override {
+        wait_loaded();
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return colour(0,1,1);
+        if (height(0) <= 0) return colour(0,1,1);
 
         // Clamp input texture coordinates to [0,1] x [1,0] fractional position
         u = interval(0,1).clamp(u);
         v = 1.0 - interval(0,1).clamp(v);  // Flip V to image coordinates
 
-        auto i = int(u * image.width());//from u = i/(N_x - 1)
-        auto j = int(v * image.height());// v = i/(N_y - 1)
-        auto pixel = image.pixel_data(i,j);
+        auto i = int(u * width(0));//from u = i/(N_x - 1)
+        auto j = int(v * height(0));// v = i/(N_y - 1)
+        unsigned char pixel[3];
+        texel(i, j, 0, pixel);
 
         auto color_scale = 1.0 / 255.0;
         return colour(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
     }
 
+    // trilinear filtering between the two mip levels whose texels are nearest the footprint in size
+    colour value(double u, double v, const point3& p, double footprint) const override {
+        wait_loaded();
+        if (height(0) <= 0 || footprint <= 0)
+            return value(u, v, p);
+
+        double level = std::log2(footprint * std::max(width(0), height(0)));
+        level = std::clamp(level, 0.0, double(level_count() - 1));
+        int lower = int(level);
+        double blend = level - lower;
+
+        u = interval(0,1).clamp(u);
+        v = 1.0 - interval(0,1).clamp(v);
+        auto filtered = bilinear(u, v, lower);
+        if (blend > 0 && lower + 1 < level_count())
+            filtered = (1 - blend) * filtered + blend * bilinear(u, v, lower + 1);
+        return filtered;
+    }
+
+    // tiles paged in from the texture cache are counted by the cache, they are shared by all the textures
+    size_t data_bytes() const override {
+        wait_loaded();
+        return image.bytes() + (tiles != nullptr ? tiles->bytes() : 0);
+    }
+
   private:
     rtw_image image;
+    shared_ptr<tiled_image> tiles;// used instead of image when the texture cache is on
+    std::shared_future<void> loading;
+    mutable std::atomic<bool> loaded{false};// saves checking the future on every lookup
+
+    void wait_loaded() const {
+        if (loaded.load(std::memory_order_acquire))
+            return;
+        loading.wait();
+        loaded.store(true, std::memory_order_release);
+    }
+
+    int level_count() const { return tiles ? tiles->level_count() : image.level_count(); }
+    int width(int level)  const { return tiles ? tiles->width(level)  : image.width(level); }
+    int height(int level) const { return tiles ? tiles->height(level) : image.height(level); }
+
+    void texel(int x, int y, int level, unsigned char rgb[3]) const {
+        if (tiles) {
+            tiles->texel(x, y, level, rgb);
+            return;
+        }
+        auto pixel = image.pixel_data(x, y, level);
+        rgb[0] = pixel[0];
+        rgb[1] = pixel[1];
+        rgb[2] = pixel[2];
+    }
+
+    colour bilinear(double u, double v, int level) const {
+        // texel centres are at half integer positions
+        double x = u * width(level) - 0.5;
+        double y = v * height(level) - 0.5;
+        int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+        double fx = x - x0, fy = y - y0;
+
+        colour result(0,0,0);
+        for (int dy = 0; dy < 2; dy++) {
+            for (int dx = 0; dx < 2; dx++) {
+                unsigned char pixel[3];
+                texel(x0 + dx, y0 + dy, level, pixel);
+                double weight = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy);
+                result += weight * colour(pixel[0], pixel[1], pixel[2]);
+            }
+        }
+        return (1.0 / 255.0) * result;
+    }
 };
 
 class noise_texture : public texture {
@@ -83,12 +337,102 @@ class noise_texture : public texture {
     noise_texture() {}
     noise_texture(double scale) : m_scale(scale) {}
     colour value(double u, double v, const point3& p) const override {//grayscale gradient
-        return colour(.5, .5, .5) * (1 + sin(m_scale * p.z() + 10 * noise.octave(p, 7)));//marbel effect wurg sin undulating the stripes
+        return colour(.5, .5, .5) * (1 + sin(m_scale * p.z() + 10 * turbulence(p)));//marbel effect wurg sin undulating the stripes
+    }
+
+    int emit(texture_program& program) const override {
+        texture_op op = {};
+        op.type = TEXTURE_NOISE;
+        op.source = this;
+        return program.add(op);
+    }
+
+    size_t data_bytes() const override { return baked.capacity() * sizeof(float); }
+
+    // Samples the turbulence over bounds into a grid with voxels cells along its longest side,
+    // points inside the bounds then interpolate the grid instead of summing 7 octaves of noise.
+    // The slices of the grid are filled in parallel on the load queue. The bounds need a size
+    // along every axis, the loader refuses flat ones.
+    void bake(const aabb& bounds, int voxels) {
+        baked_bounds = bounds;
+        double longest = std::max({ bounds.x.size(), bounds.y.size(), bounds.z.size() });
+        for (int a = 0; a < 3; a++) {
+            auto extent = bounds.axis_interval(a).size();
+            int cells = std::max(1, int(std::ceil(voxels * extent / longest)));
+            baked_count[a] = cells + 1;// samples at the cell corners
+            baked_step[a] = extent / cells;
+        }
+
+        baked.assign(size_t(baked_count[0]) * baked_count[1] * baked_count[2], 0.0f);
+        std::vector<std::shared_future<void>> slices;
+        for (int z = 0; z < baked_count[2]; z++) {
+            slices.push_back(load_queue::global().submit([this, z] {
+                std::vector<point3> points(baked_count[0]);
+                std::vector<double> values(baked_count[0]);
+                for (int y = 0; y < baked_count[1]; y++) {
+                    for (int x = 0; x < baked_count[0]; x++)
+                        points[x] = point3(baked_bounds.x.min + x * baked_step[0], baked_bounds.y.min + y * baked_step[1],
+                                           baked_bounds.z.min + z * baked_step[2]);
+                    noise.octave(points.data(), values.data(), baked_count[0], 7);
+                    for (int x = 0; x < baked_count[0]; x++)
+                        baked[(size_t(z) * baked_count[1] + y) * baked_count[0] + x] = float(values[x]);
+                }
+            }));
+        }
+        for (auto& slice : slices)
+            slice.wait();
     }
 
   private:
     perlin noise;
     double m_scale;
+    std::vector<float> baked;// turbulence at the corners of the baked grid, x fastest
+    aabb baked_bounds;
+    int baked_count[3] = { 0, 0, 0 };
+    double baked_step[3] = { 0, 0, 0 };
+
+    double turbulence(const point3& p) const {
+        if (baked.empty() || !baked_bounds.x.contains(p.x()) || !baked_bounds.y.contains(p.y())
+            || !baked_bounds.z.contains(p.z()))
+            return noise.octave(p, 7);
+
+        // trilinear interpolation between the 8 samples around p
+        int cell[3];
+        double fraction[3];
+        for (int a = 0; a < 3; a++) {
+            double x = (p[a] - baked_bounds.axis_interval(a).min) / baked_step[a];
+            cell[a] = std::min(int(x), baked_count[a] - 2);
+            fraction[a] = x - cell[a];
+        }
+        double result = 0;
+        for (int dz = 0; dz < 2; dz++)
+            for (int dy = 0; dy < 2; dy++)
+                for (int dx = 0; dx < 2; dx++) {
+                    double weight = (dx ? fraction[0] : 1 - fraction[0]) * (dy ? fraction[1] : 1 - fraction[1])
+                                  * (dz ? fraction[2] : 1 - fraction[2]);
+                    result += weight * baked[(size_t(cell[2] + dz) * baked_count[1] + cell[1] + dy) * baked_count[0] + cell[0] + dx];
+                }
+        return result;
+    }
 };
 
+inline colour texture_program::value(double u, double v, const point3& p, double footprint) const {
+    int pc = root;
+    while (ops[pc].type == TEXTURE_CHECKER)
+        pc = checker_even(ops[pc], p) ? ops[pc].even : ops[pc].odd;
+    if (ops[pc].type == TEXTURE_SOLID)
+        return ops[pc].albedo;
+    return leaf_value(ops[pc], u, v, p, footprint);
+}
+
+inline colour texture_program::leaf_value(const texture_op& op, double u, double v, const point3& p, double footprint) const {
+    // qualified calls to the final overrides, so these aren't dispatched through the vtable
+    switch (op.type) {
+        case TEXTURE_IMAGE: return static_cast<const image_texture*>(op.source)->image_texture::value(u, v, p, footprint);
+        case TEXTURE_NOISE: return static_cast<const noise_texture*>(op.source)->noise_texture::value(u, v, p);
+        case TEXTURE_SOLID: return op.albedo;
+        default:            return op.source->value(u, v, p, footprint);
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,289 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "headers.h"
+
+#include "image_manager.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Image textures kept on disk as fixed size tiles and paged into memory as they are sampled.
+// The first time an image is opened it is decoded, its mip levels are built and everything is
+// written to a tiled file in the cache directory. Later opens only read that file's header, and
+// each tile is read the first time a ray lands on it. Tiles live in an LRU shared by all the
+// textures that is kept under memory_budget bytes, and each render thread keeps a small table of
+// the tiles it used last so most lookups never touch the shared lock.
+//
+// The tiled file is a tiled_image_header, then the width and height of each level as int32 pairs,
+// then the tiles of each level in turn, row by row from the top left. Tiles are tile_size square
+// rgb bytes, the ones at the right and bottom edges padded out with zeros.
+
+const uint32_t texture_cache_version = 1;
+
+struct tiled_image_header {
+    char     magic[4];// "RTTX"
+    uint32_t version;
+    uint32_t tile_size;
+    uint32_t level_count;
+};
+
+class texture_cache;
+
+class tiled_image {
+  public:
+    static constexpr int tile_size = 64;
+    static constexpr int tile_bytes = tile_size * tile_size * 3;
+
+    tiled_image(const tiled_image&) = delete;
+    tiled_image& operator=(const tiled_image&) = delete;
+
+    int level_count() const { return int(levels.size()); }
+    int width(int level)  const { return levels[level].width; }
+    int height(int level) const { return levels[level].height; }
+    int width()  const { return width(0); }
+    int height() const { return height(0); }
+
+    // Memory taken by the image's level table, its tiles are held by the cache
+    size_t bytes() const { return levels.capacity() * sizeof(level_info); }
+
+    // Copies the rgb bytes of the texel at x,y into rgb, coordinates outside the level are
+    // clamped to its edge
+    void texel(int x, int y, int level, unsigned char rgb[3]) const;
+
+  private:
+    friend class texture_cache;
+
+    struct level_info {
+        int width, height;
+        int tiles_x;
+        uint64_t offset;// of the level's first tile in the file
+    };
+
+    texture_cache& cache;
+    uint32_t id;// tells this image's tiles apart from other images' in the cache
+    std::vector<level_info> levels;
+    mutable std::ifstream file;
+    mutable std::mutex file_mutex;
+
+    tiled_image(texture_cache& owner, uint32_t image_id) : cache(owner), id(image_id) {}
+
+    bool open(const std::string& path) {
+        file.open(path, std::ios::binary);
+        tiled_image_header header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+            || std::memcmp(header.magic, "RTTX", 4) != 0 || header.version != texture_cache_version
+            || header.tile_size != uint32_t(tile_size) || header.level_count == 0)
+            return false;
+
+        uint64_t offset = sizeof(header) + header.level_count * 2 * sizeof(int32_t);
+        for (uint32_t i = 0; i < header.level_count; i++) {
+            int32_t size[2];
+            if (!file.read(reinterpret_cast<char*>(size), sizeof(size)) || size[0] <= 0 || size[1] <= 0)
+                return false;
+            level_info level;
+            level.width = size[0];
+            level.height = size[1];
+            level.tiles_x = (level.width + tile_size - 1) / tile_size;
+            level.offset = offset;
+            offset += uint64_t(level.tiles_x) * ((level.height + tile_size - 1) / tile_size) * tile_bytes;
+            levels.push_back(level);
+        }
+        return true;
+    }
+
+    bool read_tile(int level, int tile, unsigned char* out) const {
+        std::lock_guard<std::mutex> lock(file_mutex);
+        file.clear();
+        file.seekg(std::streamoff(levels[level].offset + uint64_t(tile) * tile_bytes));
+        return bool(file.read(reinterpret_cast<char*>(out), tile_bytes));
+    }
+};
+
+class texture_cache {
+  public:
+    using tile = std::vector<unsigned char>;
+
+    std::string directory;// tiled files are kept here, the cache is off while it's empty
+    size_t memory_budget = size_t(256) << 20;// bytes of tiles kept in memory
+
+    static texture_cache& global() {
+        static texture_cache cache;
+        return cache;
+    }
+
+    bool enabled() const { return !directory.empty(); }
+
+    // Opens the tiled copy of the image, decoding the image and writing the tiled file first if
+    // this version of the image hasn't been seen before. Returns null if the image can't be loaded.
+    shared_ptr<tiled_image> open(const std::string& filename) {
+        auto source = rtw_image::locate(filename);
+        std::ifstream in(source, std::ios::binary);
+        if (source.empty() || !in) {
+            std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+            return nullptr;
+        }
+        std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        uint32_t format[2] = { texture_cache_version, uint32_t(tiled_image::tile_size) };
+        auto hash = fnv1a(format, sizeof(format), fnv1a(bytes.data(), bytes.size()));
+
+        std::ostringstream path;
+        path << directory << "/texture_" << std::hex << hash << ".rttx";
+
+        auto image = shared_ptr<tiled_image>(new tiled_image(*this, next_id++));
+        if (image->open(path.str()))
+            return image;
+
+        rtw_image decoded;
+        if (!decoded.load(source)) {
+            std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+            return nullptr;
+        }
+        if (!write_tiled(decoded, path.str())) {
+            std::cerr << "ERROR: Could not write texture cache '" << path.str() << "'.\n";
+            return nullptr;
+        }
+        image = shared_ptr<tiled_image>(new tiled_image(*this, next_id++));
+        if (!image->open(path.str()))
+            return nullptr;
+        return image;
+    }
+
+    // Returns the tile, from this thread's recent tiles, the shared LRU or the image's file
+    shared_ptr<const tile> fetch(const tiled_image& image, int level, int index) {
+        uint64_t key = (uint64_t(image.id) << 40) | (uint64_t(level) << 32) | uint32_t(index);
+
+        struct recent_tile {
+            uint64_t key = ~uint64_t(0);
+            shared_ptr<const tile> data;
+        };
+        thread_local recent_tile recent[64];
+        auto& slot = recent[(key ^ (key >> 29)) * 0x9E3779B97F4A7C15ull >> 58];
+        if (slot.key == key)
+            return slot.data;
+
+        auto data = find(key);
+        if (data == nullptr) {
+            auto loaded = std::make_shared<tile>(tiled_image::tile_bytes);
+            if (!image.read_tile(level, index, loaded->data()))
+                std::fill(loaded->begin(), loaded->end(), 0);
+            data = insert(key, loaded);
+        }
+        slot.key = key;
+        slot.data = data;
+        return data;
+    }
+
+    uint64_t tiles_read() const { return reads; }
+    uint64_t tiles_evicted() const { return evictions; }
+
+    // Bytes of tiles held in memory now
+    size_t resident() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return resident_bytes;
+    }
+
+  private:
+    struct entry {
+        shared_ptr<const tile> data;
+        std::list<uint64_t>::iterator position;
+    };
+
+    std::mutex mutex;
+    std::list<uint64_t> lru;// most recently used first
+    std::unordered_map<uint64_t, entry> tiles;
+    size_t resident_bytes = 0;
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint32_t> next_id{0};
+
+    shared_ptr<const tile> find(uint64_t key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = tiles.find(key);
+        if (found == tiles.end())
+            return nullptr;
+        lru.splice(lru.begin(), lru, found->second.position);
+        return found->second.data;
+    }
+
+    shared_ptr<const tile> insert(uint64_t key, shared_ptr<const tile> data) {
+        // the tile was read without the lock held, another thread may have read it too
+        std::lock_guard<std::mutex> lock(mutex);
+        reads++;
+        auto found = tiles.find(key);
+        if (found != tiles.end())
+            return found->second.data;
+
+        lru.push_front(key);
+        tiles[key] = entry{ data, lru.begin() };
+        resident_bytes += data->size();
+        while (resident_bytes > memory_budget && lru.size() > 1) {
+            auto oldest = tiles.find(lru.back());
+            resident_bytes -= oldest->second.data->size();
+            tiles.erase(oldest);
+            lru.pop_back();
+            evictions++;
+        }
+        return data;
+    }
+
+    static bool write_tiled(const rtw_image& image, const std::string& path) {
+        // written under a temporary name and renamed so other processes never open half a file
+        static std::atomic<uint32_t> writes{0};// two textures of the same image may be written at once
+        auto temporary = path + "." + std::to_string(writes++) + ".tmp";
+        std::ofstream out(temporary, std::ios::binary);
+        if (!out)
+            return false;
+
+        const int size = tiled_image::tile_size;
+        tiled_image_header header;
+        std::memcpy(header.magic, "RTTX", 4);
+        header.version = texture_cache_version;
+        header.tile_size = uint32_t(size);
+        header.level_count = uint32_t(image.level_count());
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (int level = 0; level < image.level_count(); level++) {
+            int32_t dimensions[2] = { image.width(level), image.height(level) };
+            out.write(reinterpret_cast<const char*>(dimensions), sizeof(dimensions));
+        }
+
+        std::vector<unsigned char> tile(tiled_image::tile_bytes);
+        for (int level = 0; level < image.level_count(); level++) {
+            int width = image.width(level), height = image.height(level);
+            for (int ty = 0; ty < height; ty += size) {
+                for (int tx = 0; tx < width; tx += size) {
+                    std::fill(tile.begin(), tile.end(), 0);
+                    for (int y = ty; y < std::min(ty + size, height); y++)
+                        std::memcpy(&tile[((y - ty) * size) * 3], image.pixel_data(tx, y, level),
+                                    3 * (std::min(tx + size, width) - tx));
+                    out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+                }
+            }
+        }
+        out.close();
+        if (!out || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+inline void tiled_image::texel(int x, int y, int level, unsigned char rgb[3]) const {
+    const auto& info = levels[level];
+    x = x < 0 ? 0 : (x < info.width ? x : info.width - 1);
+    y = y < 0 ? 0 : (y < info.height ? y : info.height - 1);
+    auto data = cache.fetch(*this, level, (y / tile_size) * info.tiles_x + x / tile_size);
+    std::memcpy(rgb, data->data() + ((y % tile_size) * tile_size + x % tile_size) * 3, 3);
+}
+
+#endif
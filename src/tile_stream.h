@@ -0,0 +1,176 @@
+#ifndef TILE_STREAM_H
+#define TILE_STREAM_H
+
+#include "headers.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+// Finished tiles handed to viewers and compositors while the rest of the image is rendering.
+// camera::on_tile is called with each tile as soon as it is done, and the sinks below pass the
+// tiles on as binary blocks: a tile_stream_header followed by the tile's pixels as linear rgb
+// floats, rows from the top.
+
+struct tile_block {
+    int x0, y0;          // Top left pixel of the tile in the image
+    int width, height;   // Size of the tile, smaller than the camera's tile_size at the edges of the image or crop window
+    int image_width, image_height;
+    int pass;            // Progressive pass the tile finished, 0 for single pass renders
+    const float* pixels; // width * height rgb triples, the average of each pixel's samples so far
+};
+
+using tile_callback = std::function<void(const tile_block&)>;
+
+struct tile_stream_header {
+    char magic[4];// "TILE"
+    int32_t x0, y0;
+    int32_t width, height;
+    int32_t image_width, image_height;
+    int32_t pass;
+};
+
+inline tile_stream_header make_tile_header(const tile_block& tile) {
+    tile_stream_header header;
+    std::memcpy(header.magic, "TILE", 4);
+    header.x0 = tile.x0;
+    header.y0 = tile.y0;
+    header.width = tile.width;
+    header.height = tile.height;
+    header.image_width = tile.image_width;
+    header.image_height = tile.image_height;
+    header.pass = tile.pass;
+    return header;
+}
+
+// Writes each tile to a stream, which can be a pipe or fifo opened as a file
+inline tile_callback tile_stream_writer(std::ostream& out) {
+    return [&out](const tile_block& tile) {
+        auto header = make_tile_header(tile);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(tile.pixels), sizeof(float) * 3 * tile.width * tile.height);
+        out.flush();// readers see the tile now rather than when the buffer fills
+    };
+}
+
+#ifndef _WIN32
+
+// Ring of tile slots in POSIX shared memory that readers in other processes map by name. The one
+// writer never waits for readers, a reader that falls a whole ring behind skips the tiles it missed.
+//
+// A reader waits for tile_ring_header::next to move, then for each new tile n reads slot n % slot_count:
+// the slot's sequence is 2n + 2 once tile n is complete, odd while a tile is being written into it,
+// and the copy is only good if the sequence is unchanged after copying it.
+struct tile_ring_header {
+    char magic[4];// "TRNG"
+    uint32_t slot_count;
+    uint32_t slot_pixels;// capacity of each slot
+    uint32_t slot_size;// bytes per slot, slots follow the header
+    std::atomic<uint64_t> next;// tiles written so far
+};
+
+struct tile_ring_slot {
+    std::atomic<uint64_t> sequence;
+    tile_stream_header header;// pixels follow
+};
+
+class shared_tile_ring {
+  public:
+    shared_tile_ring() {}
+    shared_tile_ring(const shared_tile_ring&) = delete;
+    shared_tile_ring& operator=(const shared_tile_ring&) = delete;
+
+    ~shared_tile_ring() {
+        if (memory != nullptr) {
+            munmap(memory, size);
+            shm_unlink(name.c_str());
+        }
+    }
+
+    // Creates the shared memory object, name starts with a / as in "/raytracing_tiles"
+    bool create(const std::string& ring_name, uint32_t slot_count, uint32_t slot_pixels) {
+        size_t slot_size = (sizeof(tile_ring_slot) + sizeof(float) * 3 * slot_pixels + 63) / 64 * 64;
+        size = sizeof(tile_ring_header) + slot_size * slot_count;
+        shm_unlink(ring_name.c_str());
+        int fd = shm_open(ring_name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            std::cerr << "ERROR: Could not create shared memory '" << ring_name << "'.\n";
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "ERROR: Could not map shared memory '" << ring_name << "'.\n";
+            shm_unlink(ring_name.c_str());
+            return false;
+        }
+
+        memory = static_cast<unsigned char*>(mapping);
+        name = ring_name;
+        header = new (memory) tile_ring_header();
+        header->slot_count = slot_count;
+        header->slot_pixels = slot_pixels;
+        header->slot_size = uint32_t(slot_size);
+        for (uint32_t i = 0; i < slot_count; i++)
+            new (slot(i)) tile_ring_slot();
+        std::memcpy(header->magic, "TRNG", 4);// last, readers check it before anything else
+        return true;
+    }
+
+    void push(const tile_block& tile) {
+        if (size_t(tile.width) * tile.height > header->slot_pixels)
+            return;
+        uint64_t n = header->next.load(std::memory_order_relaxed);
+        auto s = slot(n % header->slot_count);
+        s->sequence.store(2*n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s->header = make_tile_header(tile);
+        std::memcpy(reinterpret_cast<unsigned char*>(s) + sizeof(tile_ring_slot), tile.pixels,
+                    sizeof(float) * 3 * tile.width * tile.height);
+        s->sequence.store(2*n + 2, std::memory_order_release);
+        header->next.store(n + 1, std::memory_order_release);
+    }
+
+    tile_callback writer() {
+        return [this](const tile_block& tile) { push(tile); };
+    }
+
+  private:
+    std::string name;
+    unsigned char* memory = nullptr;
+    size_t size = 0;
+    tile_ring_header* header = nullptr;
+
+    tile_ring_slot* slot(uint64_t index) const {
+        return reinterpret_cast<tile_ring_slot*>(memory + sizeof(tile_ring_header) + index * header->slot_size);
+    }
+};
+
+#else
+
+class shared_tile_ring {
+  public:
+    bool create(const std::string&, uint32_t, uint32_t) {
+        std::cerr << "ERROR: The shared memory tile ring needs POSIX shared memory.\n";
+        return false;
+    }
+
+    tile_callback writer() {
+        return tile_callback();
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "headers.h"
+
+#include "hittable.h"
+#include "texture.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Path states for the wavefront integrator, see camera::wavefront. Instead of following each
+// sample's path to the end before starting the next, a whole batch of paths is advanced one
+// bounce at a time in stages: camera rays are generated for every path, the live paths' rays are
+// extended to their next hit, the hits are shaded to give the next rays, and the light each path
+// gathered is connected back to its pixel at the end. Each path has a slot in the arrays below.
+
+struct path_batch {
+    // the ray each path traces next
+    std::vector<point3> origin;
+    std::vector<vec3>   direction;
+    std::vector<double> time;
+    std::vector<double> cone_width;  // Width of the ray's cone at its origin, then where it hit
+    std::vector<double> cone_spread;
+
+    std::vector<colour> throughput;  // Product of the attenuation along the path so far
+    std::vector<colour> radiance;    // Light gathered by the path so far
+    std::vector<int>    bounces;     // Secondary rays the path has traced
+    std::vector<char>   lights_sampled; // The path's ray leaves a point in a medium whose light was sampled directly
+    std::vector<hit_record> hits;    // Where the path's last ray hit
+
+    std::vector<int> active;         // Slots of the paths whose rays are still to be traced
+    std::vector<int> shading;        // Slots of the paths whose rays hit something this bounce
+    std::vector<int> keys;           // Sort key of each slot
+    std::vector<int> scratch;
+
+    // texture lookups of the hits of one material, made together, and their results
+    std::vector<texture_query> queries;
+    std::vector<colour> albedo;
+
+    // memory each path's slot takes in the arrays above
+    static const size_t bytes_per_path = 5 * sizeof(vec3) + 3 * sizeof(double) + 5 * sizeof(int) + sizeof(char) + sizeof(hit_record)
+                                       + sizeof(texture_query);
+
+    void resize(int path_count) {
+        origin.resize(path_count);
+        direction.resize(path_count);
+        time.resize(path_count);
+        cone_width.resize(path_count);
+        cone_spread.resize(path_count);
+        throughput.resize(path_count);
+        radiance.resize(path_count);
+        bounces.resize(path_count);
+        lights_sampled.resize(path_count);
+        hits.resize(path_count);
+        keys.resize(path_count);
+    }
+
+    void start(int slot, const ray& r, double width, double spread) {
+        set_ray(slot, r, width, spread);
+        throughput[slot] = colour(1,1,1);
+        radiance[slot] = colour(0,0,0);
+        bounces[slot] = 0;
+        lights_sampled[slot] = false;
+    }
+
+    void set_ray(int slot, const ray& r, double width, double spread) {
+        origin[slot] = r.origin();
+        direction[slot] = r.direction();
+        time[slot] = r.time();
+        cone_width[slot] = width;
+        cone_spread[slot] = spread;
+    }
+
+    ray path_ray(int slot) const {
+        return ray(origin[slot], direction[slot], time[slot]);
+    }
+
+    // Stable counting sort of slots by keys[slot], keys are 0 to key_count - 1
+    void sort_by_key(std::vector<int>& slots, int key_count) {
+        std::vector<int>& starts = key_starts;
+        starts.assign(key_count + 1, 0);
+        for (int slot : slots)
+            starts[keys[slot] + 1]++;
+        for (int k = 0; k < key_count; k++)
+            starts[k + 1] += starts[k];
+        scratch.resize(slots.size());
+        for (int slot : slots)
+            scratch[starts[keys[slot]]++] = slot;
+        slots.swap(scratch);
+    }
+
+    // Orders the active rays by the octant of their direction, so rays traversing the BVH in the
+    // same order are traced one after another
+    void sort_by_direction() {
+        for (int slot : active) {
+            const auto& d = direction[slot];
+            keys[slot] = (d.x() < 0) | (d.y() < 0) << 1 | (d.z() < 0) << 2;
+        }
+        sort_by_key(active, 8);
+    }
+
+    // Groups the hits by material, so each material's scattering code and data is used for all
+    // its hits at once. Materials are numbered in the order they are first met rather than by
+    // address, so the order, and the random numbers each path draws, is the same on every run.
+    void sort_by_material() {
+        material_keys.clear();
+        for (int slot : shading) {
+            auto found = material_keys.emplace(hits[slot].mat.get(), int(material_keys.size()));
+            keys[slot] = found.first->second;
+        }
+        sort_by_key(shading, int(material_keys.size()));
+    }
+
+  private:
+    std::vector<int> key_starts;
+    std::unordered_map<const material*, int> material_keys;
+};
+
+#endif